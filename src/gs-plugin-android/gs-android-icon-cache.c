@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <bardia@furilabs.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/*
+ * A cache of store icons in the user cache directory, so icons which were
+ * seen once are never downloaded again.
+ *
+ * Files are named after a hash of the icon URL and the size they were
+ * made for, and hold the icon already scaled down to at most that size, so
+ * showing one needs no network and only a small PNG decode. Icons are
+ * never scaled up, so a small icon is only stored at the smallest size.
+ */
+
+#include "gs-android-icon-cache.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+
+/* Search results and lists, and the details page (or lists at 2x scale) */
+static const guint icon_sizes[] = { 64, 128 };
+
+static gchar *
+icon_cache_get_filename (const gchar *url,
+                         guint size,
+                         GsUtilsCacheFlags flags,
+                         GError **error)
+{
+  g_autofree gchar *hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, url, -1);
+  g_autofree gchar *basename = g_strdup_printf ("%s-%u.png", hash, size);
+
+  return gs_utils_get_cache_filename ("android-icons", basename, flags, error);
+}
+
+/**
+ * gs_android_icon_cache_lookup:
+ * @url: the icon URL
+ *
+ * Finds the cached icons for @url, with the size they really have. Only
+ * reads the PNG headers, so this is cheap enough for every search result.
+ *
+ * Returns: (transfer container) (element-type GIcon): one icon per cached
+ *   size, empty if @url is not cached
+ */
+GPtrArray *
+gs_android_icon_cache_lookup (const gchar *url)
+{
+  GPtrArray *icons = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < G_N_ELEMENTS (icon_sizes); i++) {
+    g_autofree gchar *filename = NULL;
+    g_autoptr (GFile) file = NULL;
+    GIcon *icon;
+    gint width;
+    gint height;
+
+    filename = icon_cache_get_filename (url, icon_sizes[i], GS_UTILS_CACHE_FLAG_NONE, NULL);
+    if (filename == NULL || gdk_pixbuf_get_file_info (filename, &width, &height) == NULL)
+      continue;
+
+    file = g_file_new_for_path (filename);
+    icon = g_file_icon_new (file);
+    gs_icon_set_width (icon, width);
+    gs_icon_set_height (icon, height);
+    g_ptr_array_add (icons, icon);
+  }
+
+  return icons;
+}
+
+/**
+ * gs_android_icon_cache_fetch:
+ * @session: a #SoupSession
+ * @url: the icon URL
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: return location for a #GError
+ *
+ * Downloads the icon at @url and stores it at every cached size it is at
+ * least as large as, or only at the smallest if it is smaller than that.
+ * This blocks, so it must run in a worker thread.
+ */
+gboolean
+gs_android_icon_cache_fetch (SoupSession *session,
+                             const gchar *url,
+                             GCancellable *cancellable,
+                             GError **error)
+{
+  g_autoptr (SoupMessage) msg = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GdkPixbufLoader) loader = NULL;
+  GdkPixbuf *pixbuf;
+  gint width;
+  gint height;
+
+  msg = soup_message_new (SOUP_METHOD_GET, url);
+  if (msg == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                 "Invalid icon URL %s", url);
+    return FALSE;
+  }
+
+  bytes = soup_session_send_and_read (session, msg, cancellable, error);
+  if (bytes == NULL)
+    return FALSE;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (msg))) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to download icon %s: %s", url,
+                 soup_message_get_reason_phrase (msg));
+    return FALSE;
+  }
+
+  loader = gdk_pixbuf_loader_new ();
+  if (!gdk_pixbuf_loader_write_bytes (loader, bytes, error) ||
+      !gdk_pixbuf_loader_close (loader, error))
+    return FALSE;
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  if (pixbuf == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Failed to decode icon %s", url);
+    return FALSE;
+  }
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+
+  for (guint i = 0; i < G_N_ELEMENTS (icon_sizes); i++) {
+    guint size = icon_sizes[i];
+    g_autofree gchar *filename = NULL;
+    g_autofree gchar *buffer = NULL;
+    g_autoptr (GdkPixbuf) scaled = NULL;
+    gsize buffer_len;
+
+    filename = icon_cache_get_filename (url, size,
+                                        GS_UTILS_CACHE_FLAG_WRITEABLE |
+                                        GS_UTILS_CACHE_FLAG_CREATE_DIRECTORY,
+                                        error);
+    if (filename == NULL)
+      return FALSE;
+
+    /* Never scale up, gnome-software does that when rendering. An icon
+     * which fits the smaller size is already stored there as it is, and
+     * a copy under a larger name would claim a size it doesn't have. */
+    if (i > 0 && width <= (gint) icon_sizes[i - 1] && height <= (gint) icon_sizes[i - 1]) {
+      g_unlink (filename);
+      continue;
+    }
+
+    if (width > (gint) size || height > (gint) size) {
+      gint scaled_width = width >= height ? (gint) size : MAX (1, width * (gint) size / height);
+      gint scaled_height = height >= width ? (gint) size : MAX (1, height * (gint) size / width);
+
+      scaled = gdk_pixbuf_scale_simple (pixbuf, scaled_width, scaled_height, GDK_INTERP_BILINEAR);
+    } else {
+      scaled = g_object_ref (pixbuf);
+    }
+
+    if (!gdk_pixbuf_save_to_buffer (scaled, &buffer, &buffer_len, "png", error, NULL))
+      return FALSE;
+
+    /* Written atomically, so a file that exists is always complete */
+    if (!g_file_set_contents (filename, buffer, buffer_len, error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <bardia@furilabs.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <gnome-software.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+GPtrArray *gs_android_icon_cache_lookup (const gchar   *url);
+gboolean   gs_android_icon_cache_fetch  (SoupSession   *session,
+                                         const gchar   *url,
+                                         GCancellable  *cancellable,
+                                         GError       **error);
+
+G_END_DECLS
@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <bardia@furilabs.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/*
+ * A small inverted index over the store catalog, so keyword searches can be
+ * answered without a round trip to the Android store service.
+ *
+ * The index is a single GVariant of type (uaa{sv}a(sau)):
+ *  - a format version
+ *  - the catalog entries, as returned by the service's GetCatalog method
+ *  - every token, sorted bytewise, with the ascending list of entries it
+ *    appears in
+ *
+ * Keeping it in one serialized GVariant means it can be mapped from disk
+ * and queried in place, without deserializing anything.
+ */
+
+#include "gs-android-search-index.h"
+#include <gio/gio.h>
+#include <string.h>
+
+#define SEARCH_INDEX_FORMAT_VERSION 1
+#define SEARCH_INDEX_TYPE "(uaa{sv}a(sau))"
+
+struct _GsAndroidSearchIndex
+{
+  GVariant *data;  /* SEARCH_INDEX_TYPE */
+  GVariant *entries;  /* aa{sv} */
+  GVariant *tokens;  /* a(sau), sorted by token */
+  GArray *versions;  /* GsAndroidSearchIndexVersion, sorted by id, built on first use */
+};
+
+/* Catalog fields which are split into tokens */
+static const gchar *indexed_fields[] = { "id", "name", "summary", "author" };
+
+static void
+add_tokens (GHashTable *tokens,
+            const gchar *text)
+{
+  g_autofree gchar *folded = NULL;
+  const gchar *start = NULL;
+
+  if (text == NULL)
+    return;
+
+  folded = g_utf8_casefold (text, -1);
+  for (const gchar *p = folded; ; p = g_utf8_next_char (p)) {
+    gunichar c = g_utf8_get_char (p);
+
+    if (c != 0 && g_unichar_isalnum (c)) {
+      if (start == NULL)
+        start = p;
+      continue;
+    }
+
+    if (start != NULL) {
+      g_hash_table_add (tokens, g_strndup (start, p - start));
+      start = NULL;
+    }
+
+    if (c == 0)
+      break;
+  }
+}
+
+static gint
+compare_tokens (gconstpointer a,
+                gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+static GsAndroidSearchIndex *
+search_index_new_for_data (GVariant *data)
+{
+  GsAndroidSearchIndex *index = g_new0 (GsAndroidSearchIndex, 1);
+
+  index->data = g_variant_ref_sink (data);
+  index->entries = g_variant_get_child_value (index->data, 1);
+  index->tokens = g_variant_get_child_value (index->data, 2);
+
+  return index;
+}
+
+/**
+ * gs_android_search_index_new:
+ * @catalog: an `aa{sv}` of catalog entries
+ *
+ * Builds an index over the id, name, summary and author of every entry.
+ * This is too slow to do on the main thread for a full catalog.
+ */
+GsAndroidSearchIndex *
+gs_android_search_index_new (GVariant *catalog)
+{
+  g_autoptr (GHashTable) postings = NULL;
+  g_autoptr (GPtrArray) sorted = NULL;
+  g_auto (GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(sau)"));
+  GHashTableIter postings_iter;
+  gpointer key;
+  gsize n_entries;
+
+  g_return_val_if_fail (g_variant_is_of_type (catalog, G_VARIANT_TYPE ("aa{sv}")), NULL);
+
+  postings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify) g_array_unref);
+
+  n_entries = g_variant_n_children (catalog);
+  for (gsize i = 0; i < n_entries; i++) {
+    g_autoptr (GVariant) entry = g_variant_get_child_value (catalog, i);
+    g_autoptr (GHashTable) tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    GHashTableIter iter;
+    gchar *token;
+    const gchar *id = NULL;
+
+    for (guint j = 0; j < G_N_ELEMENTS (indexed_fields); j++) {
+      const gchar *value = NULL;
+      if (g_variant_lookup (entry, indexed_fields[j], "&s", &value))
+        add_tokens (tokens, value);
+    }
+
+    /* Also match on the complete package id */
+    if (g_variant_lookup (entry, "id", "&s", &id))
+      g_hash_table_add (tokens, g_utf8_casefold (id, -1));
+
+    g_hash_table_iter_init (&iter, tokens);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &token, NULL)) {
+      GArray *entry_ids = g_hash_table_lookup (postings, token);
+      guint32 entry_id = i;
+
+      if (entry_ids == NULL) {
+        entry_ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+        g_hash_table_insert (postings, g_strdup (token), entry_ids);
+      }
+      g_array_append_val (entry_ids, entry_id);
+    }
+  }
+
+  sorted = g_ptr_array_sized_new (g_hash_table_size (postings));
+  g_hash_table_iter_init (&postings_iter, postings);
+  while (g_hash_table_iter_next (&postings_iter, &key, NULL))
+    g_ptr_array_add (sorted, key);
+  g_ptr_array_sort (sorted, compare_tokens);
+
+  for (guint i = 0; i < sorted->len; i++) {
+    const gchar *token = g_ptr_array_index (sorted, i);
+    GArray *entry_ids = g_hash_table_lookup (postings, token);
+
+    g_variant_builder_add (&builder, "(s@au)", token,
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                      entry_ids->data,
+                                                      entry_ids->len,
+                                                      sizeof (guint32)));
+  }
+
+  return search_index_new_for_data (g_variant_new ("(u@aa{sv}a(sau))",
+                                                   SEARCH_INDEX_FORMAT_VERSION,
+                                                   catalog,
+                                                   &builder));
+}
+
+/**
+ * gs_android_search_index_load:
+ * @filename: file written by gs_android_search_index_save()
+ * @error: return location for a #GError
+ *
+ * Maps a saved index from disk. The file is not read up front, so this is
+ * cheap enough to call from the main thread.
+ */
+GsAndroidSearchIndex *
+gs_android_search_index_load (const gchar *filename,
+                              GError **error)
+{
+  g_autoptr (GMappedFile) mapped_file = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GVariant) data = NULL;
+  guint32 version;
+
+  mapped_file = g_mapped_file_new (filename, FALSE, error);
+  if (mapped_file == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  data = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SEARCH_INDEX_TYPE),
+                                                       bytes, FALSE));
+
+  g_variant_get_child (data, 0, "u", &version);
+  if (version != SEARCH_INDEX_FORMAT_VERSION) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Unsupported search index version %u", version);
+    return NULL;
+  }
+
+  return search_index_new_for_data (data);
+}
+
+gboolean
+gs_android_search_index_save (GsAndroidSearchIndex *index,
+                              const gchar *filename,
+                              GError **error)
+{
+  return g_file_set_contents (filename,
+                              g_variant_get_data (index->data),
+                              g_variant_get_size (index->data),
+                              error);
+}
+
+/* Returns the position of the first token which sorts at or after @prefix */
+static gsize
+search_index_lower_bound (GsAndroidSearchIndex *index,
+                          const gchar *prefix)
+{
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (index->tokens);
+
+  while (lo < hi) {
+    gsize mid = lo + (hi - lo) / 2;
+    const gchar *token;
+
+    g_variant_get_child (index->tokens, mid, "(&s@au)", &token, NULL);
+    if (strcmp (token, prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/**
+ * gs_android_search_index_query:
+ * @index: a #GsAndroidSearchIndex
+ * @keywords: search terms
+ *
+ * Finds the entries matching all of @keywords, where a keyword matches any
+ * token it is a prefix of.
+ *
+ * Returns: (transfer container) (element-type GVariant): the matching
+ *   `a{sv}` entries, in catalog order
+ */
+GPtrArray *
+gs_android_search_index_query (GsAndroidSearchIndex *index,
+                               const gchar * const *keywords)
+{
+  g_autoptr (GHashTable) query_tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autofree guint *n_matched = NULL;
+  GPtrArray *results = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  GHashTableIter iter;
+  const gchar *query_token;
+  gsize n_entries = g_variant_n_children (index->entries);
+  gsize n_tokens = g_variant_n_children (index->tokens);
+  guint round = 0;
+
+  for (guint i = 0; keywords != NULL && keywords[i] != NULL; i++)
+    add_tokens (query_tokens, keywords[i]);
+
+  if (g_hash_table_size (query_tokens) == 0)
+    return results;
+
+  /* An entry matches if every query token matched it; n_matched counts the
+   * query tokens matched so far, so each entry is counted once per token */
+  n_matched = g_new0 (guint, n_entries);
+
+  g_hash_table_iter_init (&iter, query_tokens);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &query_token, NULL)) {
+    for (gsize i = search_index_lower_bound (index, query_token); i < n_tokens; i++) {
+      g_autoptr (GVariant) entry_ids = NULL;
+      const guint32 *ids;
+      const gchar *token;
+      gsize n_ids;
+
+      g_variant_get_child (index->tokens, i, "(&s@au)", &token, &entry_ids);
+      if (!g_str_has_prefix (token, query_token))
+        break;
+
+      ids = g_variant_get_fixed_array (entry_ids, &n_ids, sizeof (guint32));
+      for (gsize j = 0; j < n_ids; j++) {
+        if (ids[j] < n_entries && n_matched[ids[j]] == round)
+          n_matched[ids[j]] = round + 1;
+      }
+    }
+    round++;
+  }
+
+  for (gsize i = 0; i < n_entries; i++) {
+    if (n_matched[i] == round)
+      g_ptr_array_add (results, g_variant_get_child_value (index->entries, i));
+  }
+
+  return results;
+}
+
+/**
+ * gs_android_search_index_lookup:
+ * @index: a #GsAndroidSearchIndex
+ * @id: a package id
+ *
+ * Finds the catalog entry for @id, through the token for the complete id.
+ *
+ * Returns: (transfer full) (nullable): the `a{sv}` entry, or %NULL
+ */
+GVariant *
+gs_android_search_index_lookup (GsAndroidSearchIndex *index,
+                                const gchar *id)
+{
+  g_autofree gchar *id_token = g_utf8_casefold (id, -1);
+  g_autoptr (GVariant) entry_ids = NULL;
+  const guint32 *ids;
+  const gchar *token;
+  gsize n_entries = g_variant_n_children (index->entries);
+  gsize n_ids;
+  gsize i;
+
+  i = search_index_lower_bound (index, id_token);
+  if (i >= g_variant_n_children (index->tokens))
+    return NULL;
+
+  g_variant_get_child (index->tokens, i, "(&s@au)", &token, &entry_ids);
+  if (strcmp (token, id_token) != 0)
+    return NULL;
+
+  ids = g_variant_get_fixed_array (entry_ids, &n_ids, sizeof (guint32));
+  for (gsize j = 0; j < n_ids; j++) {
+    g_autoptr (GVariant) entry = NULL;
+    const gchar *entry_id = NULL;
+
+    if (ids[j] >= n_entries)
+      continue;
+
+    entry = g_variant_get_child_value (index->entries, ids[j]);
+    if (g_variant_lookup (entry, "id", "&s", &entry_id) && g_strcmp0 (entry_id, id) == 0)
+      return g_steal_pointer (&entry);
+  }
+
+  return NULL;
+}
+
+static gint
+compare_versions (gconstpointer a,
+                  gconstpointer b)
+{
+  return strcmp (((const GsAndroidSearchIndexVersion *) a)->id,
+                 ((const GsAndroidSearchIndexVersion *) b)->id);
+}
+
+/**
+ * gs_android_search_index_get_versions:
+ * @index: a #GsAndroidSearchIndex
+ *
+ * Gets the (id, versionCode) pairs of the catalog entries which have a
+ * versionCode, sorted by id for binary search. The ids point into @index.
+ *
+ * Returns: (transfer none) (element-type GsAndroidSearchIndexVersion): the
+ *   versions
+ */
+GArray *
+gs_android_search_index_get_versions (GsAndroidSearchIndex *index)
+{
+  gsize n_entries;
+
+  if (index->versions != NULL)
+    return index->versions;
+
+  n_entries = g_variant_n_children (index->entries);
+  index->versions = g_array_sized_new (FALSE, FALSE, sizeof (GsAndroidSearchIndexVersion), n_entries);
+
+  for (gsize i = 0; i < n_entries; i++) {
+    g_autoptr (GVariant) entry = g_variant_get_child_value (index->entries, i);
+    GsAndroidSearchIndexVersion version = { NULL, 0 };
+
+    if (g_variant_lookup (entry, "id", "&s", &version.id) &&
+        g_variant_lookup (entry, "versionCode", "x", &version.version_code))
+      g_array_append_val (index->versions, version);
+  }
+
+  g_array_sort (index->versions, compare_versions);
+
+  return index->versions;
+}
+
+void
+gs_android_search_index_free (GsAndroidSearchIndex *index)
+{
+  g_clear_pointer (&index->versions, g_array_unref);
+  g_clear_pointer (&index->tokens, g_variant_unref);
+  g_clear_pointer (&index->entries, g_variant_unref);
+  g_clear_pointer (&index->data, g_variant_unref);
+  g_free (index);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <bardia@furilabs.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GsAndroidSearchIndex GsAndroidSearchIndex;
+
+typedef struct {
+  const gchar *id;
+  gint64 version_code;
+} GsAndroidSearchIndexVersion;
+
+GsAndroidSearchIndex *gs_android_search_index_new          (GVariant              *catalog);
+GsAndroidSearchIndex *gs_android_search_index_load         (const gchar           *filename,
+                                                            GError               **error);
+gboolean              gs_android_search_index_save         (GsAndroidSearchIndex  *index,
+                                                            const gchar           *filename,
+                                                            GError               **error);
+GPtrArray            *gs_android_search_index_query        (GsAndroidSearchIndex  *index,
+                                                            const gchar * const   *keywords);
+GVariant             *gs_android_search_index_lookup       (GsAndroidSearchIndex  *index,
+                                                            const gchar           *id);
+GArray               *gs_android_search_index_get_versions (GsAndroidSearchIndex  *index);
+void                  gs_android_search_index_free         (GsAndroidSearchIndex  *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GsAndroidSearchIndex, gs_android_search_index_free)
+
+G_END_DECLS
@@ -5,6 +5,8 @@
  */
 
 #include "gs-plugin-android.h"
+#include "gs-android-icon-cache.h"
+#include "gs-android-search-index.h"
 #include <appstream.h>
 #include <json-glib/json-glib.h>
 #include <glib/gi18n.h>
@@ -17,574 +19,3661 @@ struct _GsPluginAndroid
   GsPlugin parent;
 
   GDBusProxy *fdroid_proxy;  /* Proxy for FuriOS Android Store */
+  SoupSession *soup_session;  /* For icon downloads, used from worker threads */
+  GQueue icon_prefetch_queue;  /* IconPrefetch, most wanted first */
+  GHashTable *icon_prefetch_urls;  /* URL → IconPrefetch queued or being downloaded */
+  guint n_icon_prefetch_jobs;
+  guint max_icon_prefetch_jobs;  /* Icons downloaded at once */
+  GCancellable *icon_prefetch_cancellable;
+  GList *jobs;  /* PackageJob of the running installs and updates */
+  guint max_downloads;  /* Packages downloaded at once by a job */
+  gboolean pipelined_updates_unsupported;  /* Service only has UpgradePackages */
+  gboolean upgrade_results_unsupported;  /* UpgradePackages only returns (b) */
   GsAppList *installed_apps;  /* List of installed apps */
-  GsAppList *updatable_apps;  /* List of apps with updates */
+  gboolean installed_apps_valid;  /* Confirmed by the service, then kept up to date by package signals */
+  guint reload_id;  /* Pending reload for package signals */
+  GHashTable *installed_package_names;  /* Set of installed package names */
+  GHashTable *updatable_apps;  /* Package name → GsApp with an update */
+  gboolean upgradable_checked;  /* GetUpgradable answered since the last refresh */
+  GHashTable *staged_packages;  /* Package name → version downloaded ahead of installing */
+  GVariant *last_installed;  /* Last replies, saved as the cold-start snapshot */
+  GVariant *last_upgradable;
+  GVariant *last_repositories;
+  gboolean delta_sync_unsupported;  /* Service has no Get…Since methods */
+  guint64 installed_generation;  /* Service generations of the last replies */
+  guint64 upgradable_generation;
+  guint64 repositories_generation;
+  gboolean serving_snapshot;  /* Lists come from the snapshot until revalidated */
+  guint n_snapshot_revalidations;
+  gboolean search_apps_unsupported;  /* Service only has the JSON Search method */
+  gboolean app_details_unsupported;  /* Service has no GetAppDetails method */
+  GsAndroidSearchIndex *search_index;  /* Local index of the catalog, may be NULL */
+  GHashTable *search_cache;  /* Normalized keywords → SearchCacheEntry */
+  GQueue search_cache_lru;  /* Keys of search_cache, most recently used first */
+  GCancellable *search_cancellable;  /* Cancels the in-flight service search */
+  gchar *search_query;  /* Query of the in-flight service search */
 };
 
 G_DEFINE_TYPE (GsPluginAndroid, gs_plugin_android, GS_TYPE_PLUGIN);
 
-static void
-fdroid_proxy_setup_cb (GObject      *source_object,
-                       GAsyncResult *res,
-                       gpointer      user_data)
+/* Number of recent searches whose results are kept */
+#define SEARCH_CACHE_SIZE 16
+
+/* Snapshot of the last known lists: format version, then the generation
+ * and last GetInstalledApps, GetUpgradable and GetRepositories reply, if any */
+#define SNAPSHOT_FORMAT_VERSION 2
+#define SNAPSHOT_FORMAT "(utm@aa{sv}tm@aa{sv}tm@a(ss))"
+#define SNAPSHOT_TYPE "(utmaa{sv}tmaa{sv}tma(ss))"
+
+/* Packages downloaded ahead of installing, which the service keeps across
+ * sessions: format version, then package name → version */
+#define STAGED_FORMAT_VERSION 1
+#define STAGED_FORMAT "(ua{ss})"
+
+/* Icons downloaded at the same time, unless overridden by
+ * GS_PLUGIN_ANDROID_ICON_JOBS, icons prefetched from the top of each list,
+ * and icons left waiting before the oldest are dropped */
+#define ICON_PREFETCH_MAX_JOBS 4
+#define ICON_PREFETCH_MAX_JOBS_LIMIT 16
+#define ICON_PREFETCH_MAX_APPS 24
+#define ICON_PREFETCH_MAX_QUEUED 64
+
+/* How long package signals are collected before gnome-software reloads */
+#define RELOAD_DELAY_MS 500
+
+/* What an app of a search was matched against, and how well. Apps are
+ * shared between searches, so their match value only holds for the search
+ * which set it last. */
+typedef struct {
+  gchar *text;  /* search_result_dup_text() */
+  guint score;  /* search_result_score() for the keywords of the search */
+} SearchMatch;
+
+static SearchMatch *
+search_match_new (gchar *text,
+                  guint score)
 {
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  GsPluginAndroid *self = g_task_get_source_object (task);
-  g_autoptr (GError) error = NULL;
-  GDBusProxy *proxy;
+  SearchMatch *match = g_new0 (SearchMatch, 1);
 
-  proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
-  if (proxy == NULL) {
-    g_task_return_error (task, g_steal_pointer (&error));
-    return;
-  }
-
-  g_clear_object (&self->fdroid_proxy);
-  self->fdroid_proxy = proxy;
+  match->text = text;
+  match->score = score;
 
-  g_task_return_boolean (task, TRUE);
+  return match;
 }
 
-static gboolean
-gs_plugin_android_setup_finish (GsPlugin *plugin,
-                                GAsyncResult *result,
-                                GError **error)
+static void
+search_match_free (SearchMatch *match)
 {
-  return g_task_propagate_boolean (G_TASK (result), error);
+  g_free (match->text);
+  g_free (match);
 }
 
+typedef struct {
+  GsAppList *list;
+  GHashTable *matches;  /* GsApp of list → SearchMatch */
+  gboolean truncated;  /* list only holds the first results of the search */
+} SearchCacheEntry;
+
 static void
-gs_plugin_android_setup_async (GsPlugin *plugin,
-                               GCancellable *cancellable,
-                               GAsyncReadyCallback callback,
-                               gpointer user_data)
+search_cache_entry_free (SearchCacheEntry *entry)
 {
-  g_autoptr (GTask) task = NULL;
+  g_clear_object (&entry->list);
+  g_clear_pointer (&entry->matches, g_hash_table_unref);
+  g_free (entry);
+}
 
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_android_setup_async);
+static GHashTable *
+search_matches_new (void)
+{
+  return g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                (GDestroyNotify) search_match_free);
+}
 
-  g_debug ("Android plugin version: %s", GS_PLUGIN_ANDROID_VERSION);
+static GHashTable *
+search_matches_copy (GHashTable *matches)
+{
+  GHashTable *copy = search_matches_new ();
+  GHashTableIter iter;
+  gpointer app;
+  SearchMatch *match;
 
-  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
-                            G_DBUS_PROXY_FLAGS_NONE,
-                            NULL,
-                            "io.FuriOS.AndroidStore",
-                            "/fdroid",
-                            "io.FuriOS.AndroidStore.fdroid",
-                            cancellable,
-                            fdroid_proxy_setup_cb,
-                            g_steal_pointer (&task));
+  g_hash_table_iter_init (&iter, matches);
+  while (g_hash_table_iter_next (&iter, &app, (gpointer *) &match))
+    g_hash_table_insert (copy, app, search_match_new (g_strdup (match->text), match->score));
+
+  return copy;
 }
 
+/* Gives the apps of @list the score they had in the search of @matches,
+ * just before they are handed out */
 static void
-fdroid_update_cache_cb (GObject      *source_object,
-                        GAsyncResult *res,
-                        gpointer      user_data)
+search_matches_apply (GHashTable *matches,
+                      GsAppList *list)
 {
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  GsPluginAndroid *self = g_task_get_source_object (task);
-  g_autoptr (GError) error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  GVariant *value;
-  gboolean success;
+  for (guint i = 0; i < gs_app_list_length (list); i++) {
+    GsApp *app = gs_app_list_index (list, i);
+    SearchMatch *match = g_hash_table_lookup (matches, app);
 
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
-  if (result == NULL) {
-    g_task_return_error (task, g_steal_pointer (&error));
-    return;
+    if (match != NULL)
+      gs_app_set_match_value (app, match->score);
   }
+}
 
-  value = g_variant_get_child_value (result, 0);
-  success = g_variant_get_boolean (value);
-  g_variant_unref (value);
+/* Returns a new list with at most the first @max_results apps of @list, as
+ * the caller may modify it */
+static GsAppList *
+app_list_copy_first (GsAppList *list,
+                     guint max_results)
+{
+  GsAppList *copy;
 
-  gs_plugin_updates_changed (GS_PLUGIN (self));
-  g_task_return_boolean (task, success);
+  if (max_results == 0 || gs_app_list_length (list) <= max_results)
+    return gs_app_list_copy (list);
+
+  copy = gs_app_list_new ();
+  for (guint i = 0; i < max_results; i++)
+    gs_app_list_add (copy, gs_app_list_index (list, i));
+
+  return copy;
 }
 
-static gboolean
-gs_plugin_android_refresh_metadata_finish (GsPlugin *plugin,
-                                           GAsyncResult *result,
-                                           GError **error)
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
 {
-  return g_task_propagate_boolean (G_TASK (result), error);
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
 }
 
-static void
-gs_plugin_android_refresh_metadata_async (GsPlugin *plugin,
-                                          guint64 cache_age_secs,
-                                          GsPluginRefreshMetadataFlags flags,
-                                          GCancellable *cancellable,
-                                          GAsyncReadyCallback callback,
-                                          gpointer user_data)
+/* Keywords are case folded, sorted and deduplicated so that equivalent
+ * queries share a cache entry */
+static gchar *
+search_cache_key_new (const gchar * const *keywords)
 {
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
-  g_autoptr (GTask) task = NULL;
+  g_autoptr (GPtrArray) folded = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GString) key = g_string_new (NULL);
 
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_android_refresh_metadata_async);
+  for (guint i = 0; keywords[i] != NULL; i++)
+    g_ptr_array_add (folded, g_utf8_casefold (keywords[i], -1));
+  g_ptr_array_sort (folded, compare_strings);
 
-  g_debug ("Refreshing repositories");
+  for (guint i = 0; i < folded->len; i++) {
+    const gchar *keyword = g_ptr_array_index (folded, i);
 
-  gs_plugin_status_update (plugin, NULL, GS_PLUGIN_STATUS_DOWNLOADING);
-  g_dbus_proxy_call (self->fdroid_proxy,
-                     "UpdateCache",
-                     g_variant_new ("()"),
-                     G_DBUS_CALL_FLAGS_NONE,
-                     -1,  /* timeout, -1 for default */
-                     cancellable,
-                     fdroid_update_cache_cb,
-                     g_steal_pointer (&task));
+    if (i > 0 && g_strcmp0 (keyword, g_ptr_array_index (folded, i - 1)) == 0)
+      continue;
+    if (key->len > 0)
+      g_string_append_c (key, ' ');
+    g_string_append (key, keyword);
+  }
+
+  return g_string_free (g_steal_pointer (&key), FALSE);
 }
 
-static void
-fdroid_get_repositories_cb (GObject *source_object,
-                            GAsyncResult *res,
-                            gpointer user_data)
+static SearchCacheEntry *
+gs_plugin_android_search_cache_lookup (GsPluginAndroid *self,
+                                       const gchar *key)
 {
-  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object(task));
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) repositories = NULL;
-  g_autoptr (GsAppList) list = gs_app_list_new ();
+  SearchCacheEntry *entry;
+  GList *link;
 
-  repositories = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
-  if (repositories == NULL) {
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer(&local_error));
+  entry = g_hash_table_lookup (self->search_cache, key);
+  if (entry == NULL)
+    return NULL;
+
+  link = g_queue_find_custom (&self->search_cache_lru, key, (GCompareFunc) g_strcmp0);
+  g_queue_unlink (&self->search_cache_lru, link);
+  g_queue_push_head_link (&self->search_cache_lru, link);
+
+  return entry;
+}
+
+/* Adds or replaces the cached results for @key. @matches holds what each app
+ * of @list was matched against and its score, so the results can be
+ * refined and served again later. */
+static void
+gs_plugin_android_search_cache_add (GsPluginAndroid *self,
+                                    const gchar *key,
+                                    GsAppList *list,
+                                    GHashTable *matches,
+                                    gboolean truncated)
+{
+  SearchCacheEntry *entry;
+  gchar *owned_key;
+
+  entry = gs_plugin_android_search_cache_lookup (self, key);
+  if (entry != NULL) {
+    g_clear_object (&entry->list);
+    g_clear_pointer (&entry->matches, g_hash_table_unref);
+    entry->list = gs_app_list_copy (list);
+    entry->matches = g_hash_table_ref (matches);
+    entry->truncated = truncated;
     return;
   }
 
-  GVariantIter *iter = NULL;
-  const gchar *repo_name = NULL;
-  const gchar *repo_url = NULL;
-  g_variant_get (repositories, "(a(ss))", &iter);
+  while (g_queue_get_length (&self->search_cache_lru) >= SEARCH_CACHE_SIZE) {
+    const gchar *oldest = g_queue_pop_tail (&self->search_cache_lru);
+    g_hash_table_remove (self->search_cache, oldest);
+  }
 
-  while (g_variant_iter_next (iter, "(&s&s)", &repo_name, &repo_url)) {
-    g_autoptr (GsApp) app = NULL;
+  entry = g_new0 (SearchCacheEntry, 1);
+  entry->list = gs_app_list_copy (list);
+  entry->matches = g_hash_table_ref (matches);
+  entry->truncated = truncated;
 
-    g_debug ("Processing F-Droid repository: %s (%s)", repo_name, repo_url);
+  owned_key = g_strdup (key);
+  g_hash_table_insert (self->search_cache, owned_key, entry);
+  g_queue_push_head (&self->search_cache_lru, owned_key);
+}
 
-    app = gs_app_new (repo_name);
-    gs_app_set_kind (app, AS_COMPONENT_KIND_REPOSITORY);
-    gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
-    gs_app_set_state (app, GS_APP_STATE_INSTALLED);
-    gs_app_add_quirk (app, GS_APP_QUIRK_NOT_LAUNCHABLE);
-    gs_app_set_name (app, GS_APP_QUALITY_NORMAL, repo_name);
-    gs_app_set_url (app, AS_URL_KIND_HOMEPAGE, repo_url);
-    gs_app_set_metadata (app, "fdroid::repo-url", repo_url);
-    gs_app_set_management_plugin (app, GS_PLUGIN (self));
-    gs_app_set_metadata (app, "GnomeSoftware::SortKey", "300");
-    gs_app_set_origin_ui (app, "F-Droid (Android)");
+static guint search_text_score (const gchar *text,
+                               gchar **words);
 
-    gs_plugin_cache_add (GS_PLUGIN (self), repo_url, app);
-    gs_app_list_add (list, g_steal_pointer (&app));
-  }
+/* Best score first, as search results are ranked */
+static gint
+compare_search_matches (GsApp *app1,
+                        GsApp *app2,
+                        gpointer user_data)
+{
+  GHashTable *matches = user_data;
+  SearchMatch *match1 = g_hash_table_lookup (matches, app1);
+  SearchMatch *match2 = g_hash_table_lookup (matches, app2);
 
-  g_variant_iter_free (iter);
-  g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+  if (match1->score != match2->score)
+    return match1->score > match2->score ? -1 : 1;
+  return 0;
 }
 
-static void
-fdroid_get_upgradable_cb (GObject *source_object,
-                          GAsyncResult *res,
-                          gpointer user_data)
+/* Whether a query for @words can only match a subset of what @cached_key
+ * matched, i.e. every cached keyword is contained in one of @words */
+static gboolean
+search_key_refines (const gchar *cached_key,
+                    gchar **words)
 {
-  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  g_autoptr (GsAppList) list = gs_app_list_new ();
-  GVariantIter iter;
-  GVariant *child;
-  guint upgradable_count = 0;
+  g_auto (GStrv) cached_words = g_strsplit (cached_key, " ", -1);
 
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
-  if (result == NULL) {
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
-  }
+  for (guint i = 0; cached_words[i] != NULL; i++) {
+    gboolean contained = FALSE;
 
-  /* Parse upgradable apps and save them */
-  g_variant_iter_init (&iter, g_variant_get_child_value (result, 0));
-  while ((child = g_variant_iter_next_value (&iter))) {
-    g_autoptr (GsApp) app = NULL;
-    g_autoptr (GVariantDict) dict = NULL;
-    const gchar *package_name = NULL;
-    const gchar *name = NULL;
-    const gchar *id = NULL;
-    const gchar *current_version = NULL;
-    const gchar *available_version = NULL;
-    const gchar *repository = NULL;
-    const gchar *package_info = NULL;
+    for (guint j = 0; words[j] != NULL && !contained; j++)
+      contained = strstr (words[j], cached_words[i]) != NULL;
+    if (!contained)
+      return FALSE;
+  }
 
-    dict = g_variant_dict_new (child);
-    g_variant_dict_lookup (dict, "packageName", "&s", &package_name);
-    g_variant_dict_lookup (dict, "name", "&s", &name);
-    g_variant_dict_lookup (dict, "id", "&s", &id);
-    g_variant_dict_lookup (dict, "currentVersion", "&s", &current_version);
-    g_variant_dict_lookup (dict, "availableVersion", "&s", &available_version);
-    g_variant_dict_lookup (dict, "repository", "&s", &repository);
-    g_variant_dict_lookup (dict, "package", "&s", &package_info);
+  return TRUE;
+}
 
-    if (package_name != NULL) {
-      app = gs_app_new (id);
-      gs_app_set_kind (app, AS_COMPONENT_KIND_DESKTOP_APP);
-      gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
-      gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
-      gs_app_set_allow_cancel (app, FALSE);
-      gs_app_set_management_plugin (app, GS_PLUGIN (self));
+static gboolean
+text_matches_words (const gchar *text,
+                    gchar **words)
+{
+  if (text == NULL)
+    return FALSE;
 
-      if (name != NULL && *name != '\0')
-        gs_app_set_name (app, GS_APP_QUALITY_NORMAL, name);
-      else
-        gs_app_set_name (app, GS_APP_QUALITY_LOWEST, package_name);
+  for (guint i = 0; words[i] != NULL; i++) {
+    if (strstr (text, words[i]) == NULL)
+      return FALSE;
+  }
 
-      gs_app_set_metadata (app, "android::package-name", id);
-      if (repository != NULL)
-        gs_app_set_metadata (app, "android-store::repository", repository);
+  return TRUE;
+}
 
-      gs_app_add_source (app, id);
-      gs_app_set_metadata (app, "GnomeSoftware::PackagingFormat", "apk");
-      gs_app_set_state (app, GS_APP_STATE_UPDATABLE);
-      gs_app_add_kudo (app, GS_APP_KUDO_SANDBOXED_SECURE);
+/* While the user is typing, each query usually extends the previous one,
+ * so its results can be filtered from a cached broader search rather than
+ * asking the service again. The filter looks at the same fields as the
+ * search did, not at what the apps happen to have set. */
+static GsAppList *
+gs_plugin_android_search_cache_refine (GsPluginAndroid *self,
+                                       const gchar *key,
+                                       GHashTable **matches)
+{
+  g_auto (GStrv) words = g_strsplit (key, " ", -1);
 
-      if (current_version != NULL)
-        gs_app_set_version (app, current_version);
-      if (available_version != NULL)
-        gs_app_set_update_version (app, available_version);
+  for (GList *l = self->search_cache_lru.head; l != NULL; l = l->next) {
+    const gchar *cached_key = l->data;
+    SearchCacheEntry *entry;
+    GsAppList *cached;
+    GsAppList *list;
 
-      gs_app_list_add (list, app);
-      gs_app_list_add (self->updatable_apps, app);
-      upgradable_count++;
+    /* A partial result set can't be filtered down to a complete one */
+    entry = g_hash_table_lookup (self->search_cache, cached_key);
+    if (entry->truncated || !search_key_refines (cached_key, words))
+      continue;
 
-      g_debug ("Found upgrade for %s: %s -> %s",
-               package_name,
-               current_version != NULL ? current_version : "unknown",
-               available_version != NULL ? available_version : "unknown");
+    g_debug ("Refining cached results of '%s' for '%s'", cached_key, key);
+
+    cached = entry->list;
+    list = gs_app_list_new ();
+    *matches = search_matches_new ();
+    for (guint i = 0; i < gs_app_list_length (cached); i++) {
+      GsApp *app = gs_app_list_index (cached, i);
+      SearchMatch *match = g_hash_table_lookup (entry->matches, app);
+
+      /* The narrower keywords score differently than the cached ones */
+      if (match != NULL && text_matches_words (match->text, words)) {
+        gs_app_list_add (list, app);
+        g_hash_table_insert (*matches, app,
+                             search_match_new (g_strdup (match->text),
+                                               search_text_score (match->text, words)));
+      }
     }
-    g_variant_unref (child);
+    gs_app_list_sort (list, compare_search_matches, *matches);
+
+    return list;
   }
 
-  if (upgradable_count > 0)
-    g_debug ("Found %u upgradable Android apps", upgradable_count);
-  else
-    g_debug ("No upgradable Android apps found");
+  return NULL;
+}
 
-  g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+/* Called whenever the catalog or the installed state of apps changes */
+static void
+gs_plugin_android_search_cache_clear (GsPluginAndroid *self)
+{
+  g_queue_clear (&self->search_cache_lru);
+  g_hash_table_remove_all (self->search_cache);
+}
+
+static gchar *
+gs_plugin_android_get_search_index_filename (GError **error)
+{
+  return gs_utils_get_cache_filename ("android",
+                                      "search-index",
+                                      GS_UTILS_CACHE_FLAG_WRITEABLE |
+                                      GS_UTILS_CACHE_FLAG_CREATE_DIRECTORY,
+                                      error);
 }
 
 static void
-fdroid_get_installed_apps_cb (GObject *source_object,
-                              GAsyncResult *res,
-                              gpointer user_data)
+gs_plugin_android_load_search_index (GsPluginAndroid *self)
 {
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
   g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  g_autoptr (GsAppList) list = gs_app_list_new ();
-  GVariantIter iter;
-  GVariant *child;
+  g_autofree gchar *filename = NULL;
 
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
-  if (result == NULL) {
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
-  }
+  filename = gs_plugin_android_get_search_index_filename (&local_error);
+  if (filename != NULL)
+    self->search_index = gs_android_search_index_load (filename, &local_error);
 
-  /* Clear previous list and build new one */
-  gs_app_list_remove_all (self->installed_apps);
+  if (self->search_index == NULL)
+    g_debug ("No local search index, searching via the service: %s",
+             local_error->message);
+}
 
-  g_variant_iter_init (&iter, g_variant_get_child_value (result, 0));
-  while ((child = g_variant_iter_next_value (&iter))) {
-    g_autoptr (GsApp) app = NULL;
-    g_autoptr (GVariantDict) dict = NULL;
-    const gchar *package_name = NULL;
-    const gchar *name = NULL;
-    const gchar *id = NULL;
+/* Returns the one GsApp for @package_name, creating it on first use, so that
+ * search results, installed apps and updates all share the same object.
+ * Only call this from the main thread: the lookup and the add are not
+ * atomic, and the app is shared with the UI. */
+static GsApp *
+gs_plugin_android_get_app (GsPluginAndroid *self,
+                           const gchar *id,
+                           const gchar *package_name)
+{
+  GsApp *app;
+
+  app = gs_plugin_cache_lookup (GS_PLUGIN (self), package_name);
+  if (app != NULL)
+    return app;
+
+  app = gs_app_new (id != NULL ? id : package_name);
+  gs_app_set_kind (app, AS_COMPONENT_KIND_DESKTOP_APP);
+  gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
+  gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
+  gs_app_add_quirk (app, GS_APP_QUIRK_HAS_SOURCE);
+  gs_app_set_allow_cancel (app, FALSE);
+  gs_app_set_management_plugin (app, GS_PLUGIN (self));
+  gs_app_set_metadata (app, "GnomeSoftware::Creator",
+                       gs_plugin_get_name (GS_PLUGIN (self)));
+  gs_app_set_metadata (app, "GnomeSoftware::PackagingFormat", "apk");
+  gs_app_set_metadata (app, "android::package-name", package_name);
+  gs_app_add_source (app, id != NULL ? id : package_name);
+  gs_app_add_kudo (app, GS_APP_KUDO_SANDBOXED_SECURE);
+
+  gs_plugin_cache_add (GS_PLUGIN (self), package_name, app);
+
+  return app;
+}
 
-    dict = g_variant_dict_new (child);
-    g_variant_dict_lookup (dict, "packageName", "&s", &package_name);
-    g_variant_dict_lookup (dict, "name", "&s", &name);
-    g_variant_dict_lookup (dict, "id", "&s", &id);
+/* gs_app_set_metadata() refuses to overwrite an existing value */
+static void
+app_replace_metadata (GsApp *app,
+                      const gchar *key,
+                      const gchar *value)
+{
+  if (g_strcmp0 (gs_app_get_metadata_item (app, key), value) == 0)
+    return;
 
-    if (package_name != NULL) {
-      app = gs_app_new (id);
+  gs_app_set_metadata (app, key, NULL);
+  gs_app_set_metadata (app, key, value);
+}
 
-      gs_app_set_kind (app, AS_COMPONENT_KIND_DESKTOP_APP);
-      gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
-      gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
-      gs_app_add_quirk (app, GS_APP_QUIRK_HAS_SOURCE);
-      gs_app_set_allow_cancel (app, FALSE);
-      gs_app_set_management_plugin (app, GS_PLUGIN (self));
-      gs_app_add_kudo (app, GS_APP_KUDO_SANDBOXED_SECURE);
+/* Moves a shared app to @state as seen by the service, without disturbing
+ * an install or removal which is in progress */
+static void
+app_update_state (GsApp *app,
+                  GsAppState state)
+{
+  GsAppState current = gs_app_get_state (app);
 
-      if (name != NULL && *name != '\0')
-        gs_app_set_name (app, GS_APP_QUALITY_NORMAL, name);
-      else
-        gs_app_set_name (app, GS_APP_QUALITY_LOWEST, package_name);
+  if (current == state ||
+      current == GS_APP_STATE_INSTALLING ||
+      current == GS_APP_STATE_REMOVING)
+    return;
 
-      gs_app_set_metadata (app, "android::package-name", package_name);
-      gs_app_add_source (app, id);
-      gs_app_set_state (app, GS_APP_STATE_INSTALLED);
+  /* An installed app only stops being updatable once GetUpgradable says so */
+  if (state == GS_APP_STATE_INSTALLED &&
+      (current == GS_APP_STATE_UPDATABLE || current == GS_APP_STATE_UPDATABLE_LIVE))
+    return;
 
-      gs_app_list_add (list, app);
-      gs_app_list_add (self->installed_apps, app);
+  /* Not every transition is allowed directly, e.g. installed to available */
+  if (current != GS_APP_STATE_UNKNOWN)
+    gs_app_set_state (app, GS_APP_STATE_UNKNOWN);
+  gs_app_set_state (app, state);
+}
 
-      g_debug ("Added installed Android app: %s (package: %s)",
-               gs_app_get_name (app), package_name);
-    }
+/* Replaces the icons of @app with the cached ones for @url, if there are any */
+static gboolean
+app_add_cached_icons (GsApp *app,
+                      const gchar *url)
+{
+  g_autoptr (GPtrArray) icons = gs_android_icon_cache_lookup (url);
+
+  if (icons->len == 0)
+    return FALSE;
+
+  gs_app_remove_all_icons (app);
+  for (guint i = 0; i < icons->len; i++)
+    gs_app_add_icon (app, g_ptr_array_index (icons, i));
+
+  return TRUE;
+}
+
+static gboolean
+app_has_cached_icons (GsApp *app)
+{
+  GPtrArray *icons = gs_app_get_icons (app);
+
+  for (guint i = 0; icons != NULL && i < icons->len; i++) {
+    if (G_IS_FILE_ICON (g_ptr_array_index (icons, i)))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+typedef struct {
+  gchar *url;
+  GsAppList *apps;  /* apps which get the icon once it is cached */
+} IconPrefetch;
+
+static void
+icon_prefetch_free (IconPrefetch *prefetch)
+{
+  g_free (prefetch->url);
+  g_clear_object (&prefetch->apps);
+  g_free (prefetch);
+}
+
+static void gs_plugin_android_icon_prefetch_next (GsPluginAndroid *self);
+
+static void
+icon_prefetch_thread_cb (GTask *task,
+                         gpointer source_object,
+                         gpointer task_data,
+                         GCancellable *cancellable)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (source_object);
+  IconPrefetch *prefetch = task_data;
+  g_autoptr (GError) local_error = NULL;
+
+  if (!gs_android_icon_cache_fetch (self->soup_session, prefetch->url, cancellable, &local_error)) {
+    g_task_return_error (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+icon_prefetch_cb (GObject *source_object,
+                  GAsyncResult *res,
+                  gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (source_object);
+  IconPrefetch *prefetch = g_task_get_task_data (G_TASK (res));
+  g_autoptr (GError) local_error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (res), &local_error)) {
+    if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      return;
+    /* The remote icon stays, and the next list tries again */
+    g_debug ("Failed to prefetch icon %s: %s", prefetch->url, local_error->message);
+  } else {
+    for (guint i = 0; i < gs_app_list_length (prefetch->apps); i++) {
+      GsApp *app = gs_app_list_index (prefetch->apps, i);
+
+      if (!app_has_cached_icons (app))
+        app_add_cached_icons (app, prefetch->url);
+    }
+  }
+
+  g_hash_table_remove (self->icon_prefetch_urls, prefetch->url);
+  self->n_icon_prefetch_jobs--;
+  gs_plugin_android_icon_prefetch_next (self);
+}
+
+static void
+gs_plugin_android_icon_prefetch_next (GsPluginAndroid *self)
+{
+  while (self->n_icon_prefetch_jobs < self->max_icon_prefetch_jobs &&
+         !g_queue_is_empty (&self->icon_prefetch_queue)) {
+    IconPrefetch *prefetch = g_queue_pop_head (&self->icon_prefetch_queue);
+    g_autoptr (GTask) task = NULL;
+
+    task = g_task_new (self, self->icon_prefetch_cancellable, icon_prefetch_cb, NULL);
+    g_task_set_source_tag (task, gs_plugin_android_icon_prefetch_next);
+    g_task_set_task_data (task, prefetch, (GDestroyNotify) icon_prefetch_free);
+    self->n_icon_prefetch_jobs++;
+    g_task_run_in_thread (task, icon_prefetch_thread_cb);
+  }
+}
+
+/* If @url is already queued or being downloaded, @app gets the icon along
+ * with the apps it was prefetched for, and moves to the front of the queue
+ * as it is wanted now */
+static gboolean
+gs_plugin_android_icon_prefetch_join (GsPluginAndroid *self,
+                                      const gchar *url,
+                                      GsApp *app)
+{
+  IconPrefetch *prefetch = g_hash_table_lookup (self->icon_prefetch_urls, url);
+  GList *link;
+
+  if (prefetch == NULL)
+    return FALSE;
+
+  gs_app_list_add (prefetch->apps, app);
+  link = g_queue_find (&self->icon_prefetch_queue, prefetch);
+  if (link != NULL) {
+    g_queue_unlink (&self->icon_prefetch_queue, link);
+    g_queue_push_head_link (&self->icon_prefetch_queue, link);
+  }
+
+  return TRUE;
+}
+
+/* Downloads the uncached icons of the first apps of @list into the icon
+ * cache, a few at a time. They go ahead of icons queued for earlier lists,
+ * as they are the ones on screen now. */
+static void
+gs_plugin_android_prefetch_icons (GsPluginAndroid *self,
+                                  GsAppList *list)
+{
+  guint n_apps = MIN (gs_app_list_length (list), ICON_PREFETCH_MAX_APPS);
+
+  /* Queued in reverse so the first app of the list ends up at the head */
+  for (guint i = n_apps; i > 0; i--) {
+    GsApp *app = gs_app_list_index (list, i - 1);
+    const gchar *url = gs_app_get_metadata_item (app, "android::icon-url");
+    IconPrefetch *prefetch;
+
+    if (url == NULL || app_has_cached_icons (app))
+      continue;
+
+    /* Still waiting, or already being downloaded */
+    if (gs_plugin_android_icon_prefetch_join (self, url, app))
+      continue;
+
+    prefetch = g_new0 (IconPrefetch, 1);
+    prefetch->url = g_strdup (url);
+    prefetch->apps = gs_app_list_new ();
+    gs_app_list_add (prefetch->apps, app);
+    g_hash_table_insert (self->icon_prefetch_urls, prefetch->url, prefetch);
+    g_queue_push_head (&self->icon_prefetch_queue, prefetch);
+  }
+
+  while (g_queue_get_length (&self->icon_prefetch_queue) > ICON_PREFETCH_MAX_QUEUED) {
+    IconPrefetch *stale = g_queue_pop_tail (&self->icon_prefetch_queue);
+
+    g_hash_table_remove (self->icon_prefetch_urls, stale->url);
+    icon_prefetch_free (stale);
+  }
+
+  gs_plugin_android_icon_prefetch_next (self);
+}
+
+/* Adds or updates the app described by @entry, an a{sv} as returned by
+ * GetInstalledApps or sent with a package signal. Returns (transfer none)
+ * the app, or NULL if @entry has no package name. */
+static GsApp *
+gs_plugin_android_add_installed_app (GsPluginAndroid *self,
+                                     GVariant *entry)
+{
+  g_autoptr (GsApp) app = NULL;
+  g_autoptr (GVariantDict) dict = NULL;
+  const gchar *package_name = NULL;
+  const gchar *name = NULL;
+  const gchar *id = NULL;
+  const gchar *version_name = NULL;
+  gint64 version_code;
+
+  dict = g_variant_dict_new (entry);
+  g_variant_dict_lookup (dict, "packageName", "&s", &package_name);
+  g_variant_dict_lookup (dict, "name", "&s", &name);
+  g_variant_dict_lookup (dict, "id", "&s", &id);
+  g_variant_dict_lookup (dict, "versionName", "&s", &version_name);
+
+  if (package_name == NULL)
+    return NULL;
+
+  app = gs_plugin_android_get_app (self, id, package_name);
+
+  if (name != NULL && *name != '\0')
+    gs_app_set_name (app, GS_APP_QUALITY_NORMAL, name);
+  else
+    gs_app_set_name (app, GS_APP_QUALITY_LOWEST, package_name);
+
+  if (version_name != NULL)
+    gs_app_set_version (app, version_name);
+
+  /* Compared with the catalog's to find updates without asking the service */
+  if (g_variant_dict_lookup (dict, "versionCode", "x", &version_code)) {
+    g_autofree gchar *version_code_str = g_strdup_printf ("%" G_GINT64_FORMAT, version_code);
+    app_replace_metadata (app, "android::version-code", version_code_str);
+  }
+
+  app_update_state (app, GS_APP_STATE_INSTALLED);
+
+  gs_app_list_add (self->installed_apps, app);
+  g_hash_table_add (self->installed_package_names, g_strdup (package_name));
+
+  g_debug ("Added installed Android app: %s (package: %s)",
+           gs_app_get_name (app), package_name);
+
+  /* installed_apps holds a reference */
+  return app;
+}
+
+static gchar *
+gs_plugin_android_get_cache_filename (const gchar *basename,
+                                     GError **error)
+{
+  return gs_utils_get_cache_filename ("android",
+                                      basename,
+                                      GS_UTILS_CACHE_FLAG_WRITEABLE |
+                                      GS_UTILS_CACHE_FLAG_CREATE_DIRECTORY,
+                                      error);
+}
+
+static void
+gs_plugin_android_save_staged (GsPluginAndroid *self)
+{
+  g_auto (GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{ss}"));
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) staged = NULL;
+  g_autofree gchar *filename = NULL;
+  GHashTableIter iter;
+  const gchar *package_name;
+  const gchar *version;
+
+  g_hash_table_iter_init (&iter, self->staged_packages);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &package_name, (gpointer *) &version))
+    g_variant_builder_add (&builder, "{ss}", package_name, version != NULL ? version : "");
+
+  staged = g_variant_ref_sink (g_variant_new (STAGED_FORMAT, STAGED_FORMAT_VERSION, &builder));
+
+  filename = gs_plugin_android_get_cache_filename ("staged", &local_error);
+  if (filename == NULL ||
+      !g_file_set_contents (filename,
+                            g_variant_get_data (staged),
+                            g_variant_get_size (staged),
+                            &local_error))
+    g_warning ("Failed to save staged packages: %s", local_error->message);
+}
+
+/* The downloads staged in an earlier session only need installing */
+static void
+gs_plugin_android_load_staged (GsPluginAndroid *self)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GMappedFile) mapped_file = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GVariant) staged = NULL;
+  g_autoptr (GVariant) packages = NULL;
+  g_autofree gchar *filename = NULL;
+  GVariantIter iter;
+  const gchar *package_name;
+  const gchar *version;
+  guint32 format_version;
+
+  filename = gs_plugin_android_get_cache_filename ("staged", &local_error);
+  if (filename != NULL)
+    mapped_file = g_mapped_file_new (filename, FALSE, &local_error);
+  if (mapped_file == NULL) {
+    g_debug ("No staged Android packages: %s", local_error->message);
+    return;
+  }
+
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  staged = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (STAGED_FORMAT),
+                                                         bytes, FALSE));
+
+  g_variant_get_child (staged, 0, "u", &format_version);
+  if (format_version != STAGED_FORMAT_VERSION) {
+    g_debug ("Ignoring staged packages with version %u", format_version);
+    return;
+  }
+
+  packages = g_variant_get_child_value (staged, 1);
+  g_variant_iter_init (&iter, packages);
+  while (g_variant_iter_next (&iter, "{&s&s}", &package_name, &version))
+    g_hash_table_replace (self->staged_packages, g_strdup (package_name), g_strdup (version));
+}
+
+static void
+gs_plugin_android_unstage (GsPluginAndroid *self,
+                           const gchar *package_name)
+{
+  if (g_hash_table_remove (self->staged_packages, package_name))
+    gs_plugin_android_save_staged (self);
+}
+
+static GsApp *
+app_list_find_package (GsAppList *list,
+                       const gchar *package_name)
+{
+  for (guint i = 0; i < gs_app_list_length (list); i++) {
+    GsApp *app = gs_app_list_index (list, i);
+
+    if (g_strcmp0 (gs_app_get_metadata_item (app, "android::package-name"), package_name) == 0)
+      return app;
+  }
+
+  return NULL;
+}
+
+static void
+gs_plugin_android_remove_installed_app (GsPluginAndroid *self,
+                                        const gchar *package_name)
+{
+  GsApp *app;
+
+  app = app_list_find_package (self->installed_apps, package_name);
+  if (app != NULL) {
+    g_autoptr (GsApp) removed = g_object_ref (app);
+
+    gs_app_list_remove (self->installed_apps, removed);
+    app_update_state (removed, GS_APP_STATE_AVAILABLE);
+  }
+
+  g_hash_table_remove (self->updatable_apps, package_name);
+  g_hash_table_remove (self->installed_package_names, package_name);
+  gs_plugin_android_unstage (self, package_name);
+}
+
+/* The version installing or updating @app would bring */
+static const gchar *
+app_get_target_version (GsApp *app)
+{
+  if (gs_app_get_update_version (app) != NULL)
+    return gs_app_get_update_version (app);
+  return gs_app_get_version (app);
+}
+
+/* Whether a download-only pass already fetched what @app would install */
+static gboolean
+gs_plugin_android_is_staged (GsPluginAndroid *self,
+                             GsApp *app)
+{
+  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+  const gchar *version;
+
+  if (package_name == NULL ||
+      !g_hash_table_lookup_extended (self->staged_packages, package_name, NULL, (gpointer *) &version))
+    return FALSE;
+
+  /* The download is useless once a newer version is out */
+  return g_strcmp0 (version, app_get_target_version (app)) == 0;
+}
+
+static void
+gs_plugin_android_stage_app (GsPluginAndroid *self,
+                             GsApp *app)
+{
+  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+  g_hash_table_replace (self->staged_packages, g_strdup (package_name),
+                        g_strdup (app_get_target_version (app)));
+  gs_plugin_android_save_staged (self);
+  gs_app_set_size_download (app, GS_SIZE_TYPE_VALID, 0);
+}
+
+/* app_update_state() never takes an update away, as only the service
+ * knows when there is none */
+static void
+app_clear_update (GsApp *app)
+{
+  if (gs_app_get_state (app) == GS_APP_STATE_UPDATABLE ||
+      gs_app_get_state (app) == GS_APP_STATE_UPDATABLE_LIVE) {
+    gs_app_set_state (app, GS_APP_STATE_UNKNOWN);
+    gs_app_set_state (app, GS_APP_STATE_INSTALLED);
+  }
+}
+
+/* A changed package was most likely updated, so whatever update was known
+ * for it is stale until GetUpgradable says otherwise */
+static void
+gs_plugin_android_installed_app_changed (GsPluginAndroid *self,
+                                         GsApp *app)
+{
+  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+  g_hash_table_remove (self->updatable_apps, package_name);
+  app_clear_update (app);
+}
+
+static GsAppList *
+gs_plugin_android_list_updatable (GsPluginAndroid *self)
+{
+  GsAppList *list = gs_app_list_new ();
+  GHashTableIter iter;
+  GsApp *app;
+
+  g_hash_table_iter_init (&iter, self->updatable_apps);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &app))
+    gs_app_list_add (list, app);
+
+  return list;
+}
+
+/* Builds the repository apps of a GetRepositories reply */
+static GsAppList *
+gs_plugin_android_load_repositories (GsPluginAndroid *self,
+                                     GVariant *repositories)
+{
+  GsAppList *list = gs_app_list_new ();
+  GVariantIter iter;
+  const gchar *repo_name = NULL;
+  const gchar *repo_url = NULL;
+
+  g_variant_iter_init (&iter, repositories);
+  while (g_variant_iter_next (&iter, "(&s&s)", &repo_name, &repo_url)) {
+    g_autoptr (GsApp) app = NULL;
+
+    g_debug ("Processing F-Droid repository: %s (%s)", repo_name, repo_url);
+
+    app = gs_app_new (repo_name);
+    gs_app_set_kind (app, AS_COMPONENT_KIND_REPOSITORY);
+    gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
+    gs_app_set_state (app, GS_APP_STATE_INSTALLED);
+    gs_app_add_quirk (app, GS_APP_QUIRK_NOT_LAUNCHABLE);
+    gs_app_set_name (app, GS_APP_QUALITY_NORMAL, repo_name);
+    gs_app_set_url (app, AS_URL_KIND_HOMEPAGE, repo_url);
+    gs_app_set_metadata (app, "fdroid::repo-url", repo_url);
+    gs_app_set_management_plugin (app, GS_PLUGIN (self));
+    gs_app_set_metadata (app, "GnomeSoftware::SortKey", "300");
+    gs_app_set_origin_ui (app, "F-Droid (Android)");
+
+    gs_plugin_cache_add (GS_PLUGIN (self), repo_url, app);
+    gs_app_list_add (list, g_steal_pointer (&app));
+  }
+
+  return list;
+}
+
+/* Clears the update of the apps in @previous, the updatable apps before they
+ * were replaced, which aren't updatable anymore */
+static void
+gs_plugin_android_clear_stale_updates (GsPluginAndroid *self,
+                                       GHashTable *previous)
+{
+  GHashTableIter iter;
+  GsApp *app;
+
+  g_hash_table_iter_init (&iter, previous);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &app)) {
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+    if (!g_hash_table_contains (self->updatable_apps, package_name))
+      app_clear_update (app);
+  }
+}
+
+/* Replaces the updatable apps with those of a GetUpgradable reply, which
+ * is always the complete set; apps missing from it have no update anymore */
+static GsAppList *
+gs_plugin_android_load_upgradable (GsPluginAndroid *self,
+                                   GVariant *entries)
+{
+  GsAppList *list = gs_app_list_new ();
+  g_autoptr (GHashTable) previous = g_steal_pointer (&self->updatable_apps);
+  GVariantIter iter;
+  GVariant *child;
+  guint upgradable_count = 0;
+
+  self->updatable_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+  /* Parse upgradable apps and save them */
+  g_variant_iter_init (&iter, entries);
+  while ((child = g_variant_iter_next_value (&iter))) {
+    g_autoptr (GsApp) app = NULL;
+    g_autoptr (GVariantDict) dict = NULL;
+    const gchar *package_name = NULL;
+    const gchar *name = NULL;
+    const gchar *id = NULL;
+    const gchar *current_version = NULL;
+    const gchar *available_version = NULL;
+    const gchar *repository = NULL;
+    const gchar *package_info = NULL;
+
+    dict = g_variant_dict_new (child);
+    g_variant_dict_lookup (dict, "packageName", "&s", &package_name);
+    g_variant_dict_lookup (dict, "name", "&s", &name);
+    g_variant_dict_lookup (dict, "id", "&s", &id);
+    g_variant_dict_lookup (dict, "currentVersion", "&s", &current_version);
+    g_variant_dict_lookup (dict, "availableVersion", "&s", &available_version);
+    g_variant_dict_lookup (dict, "repository", "&s", &repository);
+    g_variant_dict_lookup (dict, "package", "&s", &package_info);
+
+    if (package_name != NULL) {
+      app = gs_plugin_android_get_app (self, id, package_name);
+
+      if (name != NULL && *name != '\0')
+        gs_app_set_name (app, GS_APP_QUALITY_NORMAL, name);
+      else
+        gs_app_set_name (app, GS_APP_QUALITY_LOWEST, package_name);
+
+      if (repository != NULL)
+        app_replace_metadata (app, "android-store::repository", repository);
+
+      app_update_state (app, GS_APP_STATE_UPDATABLE);
+
+      if (current_version != NULL)
+        gs_app_set_version (app, current_version);
+      if (available_version != NULL)
+        gs_app_set_update_version (app, available_version);
+
+      /* Downloaded by an earlier pass, maybe in an earlier session */
+      if (gs_plugin_android_is_staged (self, app))
+        gs_app_set_size_download (app, GS_SIZE_TYPE_VALID, 0);
+
+      gs_app_list_add (list, app);
+      g_hash_table_replace (self->updatable_apps, g_strdup (package_name), g_object_ref (app));
+      upgradable_count++;
+
+      g_debug ("Found upgrade for %s: %s -> %s",
+               package_name,
+               current_version != NULL ? current_version : "unknown",
+               available_version != NULL ? available_version : "unknown");
+    }
     g_variant_unref (child);
   }
 
-  g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+  gs_plugin_android_clear_stale_updates (self, previous);
+
+  if (upgradable_count > 0)
+    g_debug ("Found %u upgradable Android apps", upgradable_count);
+  else
+    g_debug ("No upgradable Android apps found");
+
+  return list;
+}
+
+/* Returns the highest versionCode the catalog has for @package_name, as a
+ * package can be in more than one repository, or -1 if it has none */
+static gint64
+search_index_versions_latest (GArray *versions,
+                              const gchar *package_name)
+{
+  guint lo = 0;
+  guint hi = versions->len;
+  gint64 latest = -1;
+
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (strcmp (g_array_index (versions, GsAndroidSearchIndexVersion, mid).id, package_name) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < versions->len; lo++) {
+    const GsAndroidSearchIndexVersion *version = &g_array_index (versions, GsAndroidSearchIndexVersion, lo);
+
+    if (strcmp (version->id, package_name) != 0)
+      break;
+    latest = MAX (latest, version->version_code);
+  }
+
+  return latest;
+}
+
+/* Narrows the updates of the last GetUpgradable reply down to those still
+ * ahead of the installed versionCode, so updates installed since are
+ * dropped without asking the service. The catalog doesn't change between
+ * refreshes, so this never adds an update: versions the service filtered
+ * out stay filtered out. */
+static GsAppList *
+gs_plugin_android_compute_upgradable (GsPluginAndroid *self)
+{
+  GArray *versions;
+  GHashTableIter iter;
+  const gchar *package_name;
+  GsApp *app;
+
+  if (self->search_index == NULL)
+    return gs_plugin_android_list_updatable (self);
+
+  versions = gs_android_search_index_get_versions (self->search_index);
+
+  g_hash_table_iter_init (&iter, self->updatable_apps);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &package_name, (gpointer *) &app)) {
+    const gchar *version_code = gs_app_get_metadata_item (app, "android::version-code");
+    gint64 latest;
+
+    /* Without both versionCodes the service's word stands */
+    if (version_code == NULL)
+      continue;
+    latest = search_index_versions_latest (versions, package_name);
+    if (latest < 0 || g_ascii_strtoll (version_code, NULL, 10) < latest)
+      continue;
+
+    g_debug ("%s is up to date, dropping its update", package_name);
+    app_clear_update (app);
+    g_hash_table_iter_remove (&iter);
+  }
+
+  return gs_plugin_android_list_updatable (self);
+}
+
+/* Brings the installed apps in line with a GetInstalledApps reply. Apps
+ * which stay installed are updated in place rather than replaced, so the
+ * UI keeps its rows and only new and removed apps cause any relayout. */
+static GsAppList *
+gs_plugin_android_load_installed (GsPluginAndroid *self,
+                                  GVariant *entries)
+{
+  GsAppList *list = gs_app_list_new ();
+  g_autoptr (GHashTable) listed = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr (GPtrArray) gone = g_ptr_array_new_with_free_func (g_free);
+  guint n_installed = g_hash_table_size (self->installed_package_names);
+  GVariantIter iter;
+  GVariant *child;
+
+  g_variant_iter_init (&iter, entries);
+  while ((child = g_variant_iter_next_value (&iter))) {
+    GsApp *app = gs_plugin_android_add_installed_app (self, child);
+
+    if (app != NULL) {
+      gs_app_list_add (list, app);
+      g_hash_table_add (listed, (gpointer) gs_app_get_metadata_item (app, "android::package-name"));
+    }
+    g_variant_unref (child);
+  }
+
+  for (guint i = 0; i < gs_app_list_length (self->installed_apps); i++) {
+    GsApp *app = gs_app_list_index (self->installed_apps, i);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+    if (!g_hash_table_contains (listed, package_name))
+      g_ptr_array_add (gone, g_strdup (package_name));
+  }
+
+  for (guint i = 0; i < gone->len; i++)
+    gs_plugin_android_remove_installed_app (self, g_ptr_array_index (gone, i));
+
+  /* Cached search results share the updated apps, and only go stale if
+   * which apps are installed changed */
+  if (gone->len > 0 || g_hash_table_size (self->installed_package_names) != n_installed)
+    gs_plugin_android_search_cache_clear (self);
+
+  return list;
+}
+
+static void
+gs_plugin_android_save_snapshot (GsPluginAndroid *self)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) snapshot = NULL;
+  g_autofree gchar *filename = NULL;
+
+  snapshot = g_variant_ref_sink (g_variant_new (SNAPSHOT_FORMAT,
+                                                SNAPSHOT_FORMAT_VERSION,
+                                                self->installed_generation,
+                                                self->last_installed,
+                                                self->upgradable_generation,
+                                                self->last_upgradable,
+                                                self->repositories_generation,
+                                                self->last_repositories));
+
+  filename = gs_plugin_android_get_cache_filename ("snapshot", &local_error);
+  if (filename == NULL ||
+      !g_file_set_contents (filename,
+                            g_variant_get_data (snapshot),
+                            g_variant_get_size (snapshot),
+                            &local_error))
+    g_warning ("Failed to save snapshot: %s", local_error->message);
+}
+
+/* Remembers the latest reply for @field, saving the snapshot if it changed */
+static void
+gs_plugin_android_snapshot_update (GsPluginAndroid *self,
+                                   GVariant **field,
+                                   GVariant *reply)
+{
+  if (*field == reply || (*field != NULL && g_variant_equal (*field, reply)))
+    return;
+
+  g_clear_pointer (field, g_variant_unref);
+  *field = g_variant_ref (reply);
+  gs_plugin_android_save_snapshot (self);
+}
+
+/* Serves the lists from the last session until the service has answered,
+ * so the first view doesn't wait for the service to start */
+static void
+gs_plugin_android_load_snapshot (GsPluginAndroid *self)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GMappedFile) mapped_file = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GVariant) snapshot = NULL;
+  g_autoptr (GsAppList) installed = NULL;
+  g_autoptr (GsAppList) upgradable = NULL;
+  g_autofree gchar *filename = NULL;
+  guint32 version;
+
+  filename = gs_plugin_android_get_cache_filename ("snapshot", &local_error);
+  if (filename != NULL)
+    mapped_file = g_mapped_file_new (filename, FALSE, &local_error);
+  if (mapped_file == NULL) {
+    g_debug ("No snapshot of the Android app lists: %s", local_error->message);
+    return;
+  }
+
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  snapshot = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SNAPSHOT_TYPE),
+                                                           bytes, FALSE));
+
+  g_variant_get_child (snapshot, 0, "u", &version);
+  if (version != SNAPSHOT_FORMAT_VERSION) {
+    g_debug ("Ignoring snapshot with version %u", version);
+    return;
+  }
+
+  g_variant_get (snapshot, SNAPSHOT_FORMAT, NULL,
+                 &self->installed_generation, &self->last_installed,
+                 &self->upgradable_generation, &self->last_upgradable,
+                 &self->repositories_generation, &self->last_repositories);
+
+  if (self->last_installed != NULL)
+    installed = gs_plugin_android_load_installed (self, self->last_installed);
+  if (self->last_upgradable != NULL)
+    upgradable = gs_plugin_android_load_upgradable (self, self->last_upgradable);
+
+  self->serving_snapshot = TRUE;
+}
+
+static void gs_plugin_android_package_progress (GsPluginAndroid *self,
+                                                const gchar *package_name,
+                                                guint percentage,
+                                                const gchar *phase);
+
+static gboolean gs_plugin_android_is_job_package (GsPluginAndroid *self,
+                                                  const gchar *package_name);
+
+static gboolean
+gs_plugin_android_reload_cb (gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (user_data);
+
+  self->reload_id = 0;
+  gs_plugin_reload (GS_PLUGIN (self));
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Package signals come in bursts, e.g. one per package of a batch update,
+ * so they are answered with a single reload. Packages of a running job
+ * need none, as the job updates their apps itself. */
+static void
+gs_plugin_android_queue_reload (GsPluginAndroid *self,
+                                const gchar *package_name)
+{
+  if (package_name != NULL && gs_plugin_android_is_job_package (self, package_name))
+    return;
+
+  if (self->reload_id == 0)
+    self->reload_id = g_timeout_add (RELOAD_DELAY_MS, gs_plugin_android_reload_cb, self);
+}
+
+static void
+fdroid_signal_cb (GDBusProxy *proxy,
+                  const gchar *sender_name,
+                  const gchar *signal_name,
+                  GVariant *parameters,
+                  gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (user_data);
+
+  if (g_strcmp0 (signal_name, "PackageAdded") == 0 &&
+      g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(a{sv})"))) {
+    g_autoptr (GVariant) entry = g_variant_get_child_value (parameters, 0);
+    GsApp *app;
+
+    g_debug ("Android package added");
+    app = gs_plugin_android_add_installed_app (self, entry);
+    if (app != NULL)
+      gs_plugin_android_queue_reload (self, gs_app_get_metadata_item (app, "android::package-name"));
+  } else if (g_strcmp0 (signal_name, "PackageChanged") == 0 &&
+             g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(a{sv})"))) {
+    g_autoptr (GVariant) entry = g_variant_get_child_value (parameters, 0);
+    GsApp *app;
+
+    g_debug ("Android package changed");
+    app = gs_plugin_android_add_installed_app (self, entry);
+    if (app != NULL)
+      gs_plugin_android_installed_app_changed (self, app);
+    gs_plugin_updates_changed (GS_PLUGIN (self));
+  } else if (g_strcmp0 (signal_name, "PackageProgress") == 0 &&
+             g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sus)"))) {
+    const gchar *package_name;
+    const gchar *phase;
+    guint32 percentage;
+
+    /* Only matters for updates, and changes nothing that is cached */
+    g_variant_get (parameters, "(&su&s)", &package_name, &percentage, &phase);
+    gs_plugin_android_package_progress (self, package_name, percentage, phase);
+    return;
+  } else if (g_strcmp0 (signal_name, "PackageRemoved") == 0 &&
+             g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(s)"))) {
+    const gchar *package_name;
+
+    g_variant_get (parameters, "(&s)", &package_name);
+    g_debug ("Android package removed: %s", package_name);
+    gs_plugin_android_remove_installed_app (self, package_name);
+    gs_plugin_android_queue_reload (self, package_name);
+  } else {
+    return;
+  }
+
+  gs_plugin_android_search_cache_clear (self);
+}
+
+static void
+fdroid_name_owner_cb (GObject *object,
+                      GParamSpec *pspec,
+                      gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (user_data);
+  g_autofree gchar *name_owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (object));
+
+  /* Signals were missed while the service was gone, so the next listing
+   * does a full resync */
+  g_debug ("Android store service %s", name_owner != NULL ? "started" : "stopped");
+  self->installed_apps_valid = FALSE;
+}
+
+static void gs_plugin_android_revalidate_snapshot (GsPluginAndroid *self);
+
+static void
+fdroid_proxy_setup_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = g_task_get_source_object (task);
+  g_autoptr (GError) error = NULL;
+  GDBusProxy *proxy;
+
+  proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+  if (proxy == NULL) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  g_clear_object (&self->fdroid_proxy);
+  self->fdroid_proxy = proxy;
+
+  g_signal_connect_object (proxy, "g-signal",
+                           G_CALLBACK (fdroid_signal_cb), self, 0);
+  g_signal_connect_object (proxy, "notify::g-name-owner",
+                           G_CALLBACK (fdroid_name_owner_cb), self, 0);
+
+  if (self->serving_snapshot)
+    gs_plugin_android_revalidate_snapshot (self);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static gboolean
+gs_plugin_android_setup_finish (GsPlugin *plugin,
+                                GAsyncResult *result,
+                                GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+gs_plugin_android_setup_async (GsPlugin *plugin,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_setup_async);
+
+  g_debug ("Android plugin version: %s", GS_PLUGIN_ANDROID_VERSION);
+
+  gs_plugin_android_load_search_index (GS_PLUGIN_ANDROID (plugin));
+  gs_plugin_android_load_staged (GS_PLUGIN_ANDROID (plugin));
+  gs_plugin_android_load_snapshot (GS_PLUGIN_ANDROID (plugin));
+
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                            G_DBUS_PROXY_FLAGS_NONE,
+                            NULL,
+                            "io.FuriOS.AndroidStore",
+                            "/fdroid",
+                            "io.FuriOS.AndroidStore.fdroid",
+                            cancellable,
+                            fdroid_proxy_setup_cb,
+                            g_steal_pointer (&task));
+}
+
+static void
+build_search_index_thread_cb (GTask *task,
+                              gpointer source_object,
+                              gpointer task_data,
+                              GCancellable *cancellable)
+{
+  GVariant *catalog = task_data;
+  g_autoptr (GsAndroidSearchIndex) index = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autofree gchar *filename = NULL;
+
+  index = gs_android_search_index_new (catalog);
+
+  /* The index is still usable for this session if it can't be saved */
+  filename = gs_plugin_android_get_search_index_filename (&local_error);
+  if (filename == NULL ||
+      !gs_android_search_index_save (index, filename, &local_error))
+    g_warning ("Failed to save search index: %s", local_error->message);
+
+  g_task_return_pointer (task, g_steal_pointer (&index),
+                         (GDestroyNotify) gs_android_search_index_free);
+}
+
+static void
+build_search_index_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = g_task_get_source_object (task);
+  g_autoptr (GError) local_error = NULL;
+  GsAndroidSearchIndex *index;
+
+  index = g_task_propagate_pointer (G_TASK (res), &local_error);
+  if (index == NULL) {
+    g_warning ("Failed to build search index: %s", local_error->message);
+  } else {
+    g_clear_pointer (&self->search_index, gs_android_search_index_free);
+    self->search_index = index;
+
+    /* Searches while the index was rebuilt were answered from the old one */
+    gs_plugin_android_search_cache_clear (self);
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+fdroid_get_catalog_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = g_task_get_source_object (task);
+  g_autoptr (GTask) index_task = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+
+  /* The cache itself was refreshed, so failing to index it is not fatal */
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+      g_debug ("GetCatalog not supported by service, not building search index");
+    else
+      g_warning ("Failed to get catalog: %s", local_error->message);
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  index_task = g_task_new (self, g_task_get_cancellable (task),
+                           build_search_index_cb, g_steal_pointer (&task));
+  g_task_set_source_tag (index_task, fdroid_get_catalog_cb);
+  g_task_set_task_data (index_task, g_variant_get_child_value (result, 0),
+                        (GDestroyNotify) g_variant_unref);
+  g_task_run_in_thread (index_task, build_search_index_thread_cb);
+}
+
+static gchar *
+gs_plugin_android_get_refresh_stamp_filename (GError **error)
+{
+  return gs_utils_get_cache_filename ("android",
+                                      "last-refresh",
+                                      GS_UTILS_CACHE_FLAG_WRITEABLE |
+                                      GS_UTILS_CACHE_FLAG_CREATE_DIRECTORY,
+                                      error);
+}
+
+/* Seconds since the last successful UpdateCache, across sessions */
+static guint64
+gs_plugin_android_get_refresh_age (void)
+{
+  g_autofree gchar *filename = NULL;
+  g_autoptr (GFile) file = NULL;
+
+  filename = gs_plugin_android_get_refresh_stamp_filename (NULL);
+  if (filename == NULL)
+    return G_MAXUINT64;
+
+  file = g_file_new_for_path (filename);
+  return gs_utils_get_file_age (file);
+}
+
+/* The stamp file's modification time is the time of the last refresh */
+static void
+gs_plugin_android_touch_refresh_stamp (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autofree gchar *filename = NULL;
+
+  filename = gs_plugin_android_get_refresh_stamp_filename (&local_error);
+  if (filename == NULL ||
+      !g_file_set_contents (filename, "", 0, &local_error))
+    g_warning ("Failed to save refresh time: %s", local_error->message);
+}
+
+static void
+fdroid_update_cache_cb (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = g_task_get_source_object (task);
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  GVariant *value;
+  gboolean success;
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+  if (result == NULL) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  value = g_variant_get_child_value (result, 0);
+  success = g_variant_get_boolean (value);
+  g_variant_unref (value);
+
+  gs_plugin_updates_changed (GS_PLUGIN (self));
+  gs_plugin_android_search_cache_clear (self);
+
+  if (!success) {
+    g_task_return_boolean (task, success);
+    return;
+  }
+
+  gs_plugin_android_touch_refresh_stamp ();
+
+  /* New versions are only trusted once the service has vetted them */
+  self->upgradable_checked = FALSE;
+
+  /* Rebuild the local search index from the refreshed catalog */
+  g_dbus_proxy_call (self->fdroid_proxy,
+                     "GetCatalog",
+                     g_variant_new ("()"),
+                     G_DBUS_CALL_FLAGS_NONE,
+                     -1,
+                     g_task_get_cancellable (task),
+                     fdroid_get_catalog_cb,
+                     g_steal_pointer (&task));
+}
+
+static gboolean
+gs_plugin_android_refresh_metadata_finish (GsPlugin *plugin,
+                                           GAsyncResult *result,
+                                           GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+gs_plugin_android_refresh_metadata_async (GsPlugin *plugin,
+                                          guint64 cache_age_secs,
+                                          GsPluginRefreshMetadataFlags flags,
+                                          GCancellable *cancellable,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_refresh_metadata_async);
+
+  /* Asking for a refresh by hand always refreshes */
+  if (!(flags & GS_PLUGIN_REFRESH_METADATA_FLAGS_INTERACTIVE)) {
+    guint64 age = gs_plugin_android_get_refresh_age ();
+
+    if (age < cache_age_secs) {
+      g_debug ("Repositories were refreshed %" G_GUINT64_FORMAT "s ago, not refreshing", age);
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+  }
+
+  g_debug ("Refreshing repositories");
+
+  gs_plugin_status_update (plugin, NULL, GS_PLUGIN_STATUS_DOWNLOADING);
+  g_dbus_proxy_call (self->fdroid_proxy,
+                     "UpdateCache",
+                     g_variant_new ("()"),
+                     G_DBUS_CALL_FLAGS_NONE,
+                     -1,  /* timeout, -1 for default */
+                     cancellable,
+                     fdroid_update_cache_cb,
+                     g_steal_pointer (&task));
+}
+
+/* Calls the list method @method_name. Services with delta sync are called
+ * through its Since variant with the generation of the last reply, and
+ * only send what changed after it. */
+static void
+gs_plugin_android_call_list (GsPluginAndroid *self,
+                             const gchar *method_name,
+                             guint64 generation,
+                             GCancellable *cancellable,
+                             GAsyncReadyCallback callback,
+                             GTask *task)
+{
+  g_autofree gchar *delta_method_name = NULL;
+
+  if (self->delta_sync_unsupported) {
+    g_dbus_proxy_call (self->fdroid_proxy,
+                       method_name,
+                       g_variant_new ("()"),
+                       G_DBUS_CALL_FLAGS_NONE,
+                       -1,
+                       cancellable,
+                       callback,
+                       task);
+    return;
+  }
+
+  delta_method_name = g_strconcat (method_name, "Since", NULL);
+  g_dbus_proxy_call (self->fdroid_proxy,
+                     delta_method_name,
+                     g_variant_new ("(t)", generation),
+                     G_DBUS_CALL_FLAGS_NONE,
+                     -1,
+                     cancellable,
+                     callback,
+                     task);
+}
+
+/* Handles an error from gs_plugin_android_call_list(), retrying with the
+ * plain method if the service has no Since variant. Returns TRUE if
+ * @task was passed on. */
+static gboolean
+gs_plugin_android_call_list_retry (GsPluginAndroid *self,
+                                   const gchar *method_name,
+                                   const GError *error,
+                                   GAsyncReadyCallback callback,
+                                   GTask *task)
+{
+  if (self->delta_sync_unsupported ||
+      !g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+    return FALSE;
+
+  g_debug ("Service has no delta sync, fetching complete lists");
+  self->delta_sync_unsupported = TRUE;
+  gs_plugin_android_call_list (self, method_name, 0, g_task_get_cancellable (task),
+                               callback, task);
+  return TRUE;
+}
+
+static gchar *
+list_entry_dup_key (GVariant *entry)
+{
+  const gchar *key = NULL;
+
+  if (g_variant_is_of_type (entry, G_VARIANT_TYPE ("(ss)")))
+    g_variant_get_child (entry, 0, "&s", &key);
+  else
+    g_variant_lookup (entry, "packageName", "&s", &key);
+
+  return g_strdup (key);
+}
+
+/* Applies a delta to the complete list @previous: @entries replace the
+ * entries with the same key or are added, and @removed keys are dropped.
+ * Keys are package names, or repository names. */
+static GVariant *
+list_merge_delta (GVariant *previous,
+                  GVariant *entries,
+                  GVariant *removed)
+{
+  g_autoptr (GHashTable) replaced = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_auto (GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (g_variant_get_type (previous));
+  GVariantIter iter;
+  GVariant *child;
+  const gchar *key;
+
+  g_variant_iter_init (&iter, removed);
+  while (g_variant_iter_next (&iter, "&s", &key))
+    g_hash_table_add (replaced, g_strdup (key));
+
+  g_variant_iter_init (&iter, entries);
+  while ((child = g_variant_iter_next_value (&iter))) {
+    gchar *entry_key = list_entry_dup_key (child);
+
+    if (entry_key != NULL)
+      g_hash_table_add (replaced, entry_key);
+    g_variant_unref (child);
+  }
+
+  g_variant_iter_init (&iter, previous);
+  while ((child = g_variant_iter_next_value (&iter))) {
+    g_autofree gchar *entry_key = list_entry_dup_key (child);
+
+    if (entry_key == NULL || !g_hash_table_contains (replaced, entry_key))
+      g_variant_builder_add_value (&builder, child);
+    g_variant_unref (child);
+  }
+
+  g_variant_iter_init (&iter, entries);
+  while ((child = g_variant_iter_next_value (&iter)))
+    g_variant_builder_add_value (&builder, child);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Returns the complete list of a list reply. A reply from a Since method
+ * is (generation, complete, entries, removed); unless complete, it only
+ * has the changes after *@generation, which are merged into @last. Returns
+ * @last itself if nothing changed. */
+static GVariant *
+list_reply_get_full (GVariant *result,
+                     GVariant *last,
+                     guint64 *generation)
+{
+  g_autoptr (GVariant) entries = NULL;
+  g_autoptr (GVariant) removed = NULL;
+  guint64 reply_generation;
+  gboolean complete;
+
+  if (g_variant_n_children (result) == 1) {
+    *generation = 0;
+    return g_variant_get_child_value (result, 0);
+  }
+
+  g_variant_get (result, "(tb@*@as)", &reply_generation, &complete, &entries, &removed);
+
+  if (last != NULL && !complete && reply_generation == *generation)
+    return g_variant_ref (last);
+
+  *generation = reply_generation;
+  if (complete || last == NULL)
+    return g_steal_pointer (&entries);
+
+  return list_merge_delta (last, entries, removed);
+}
+
+static void
+fdroid_get_repositories_cb (GObject *source_object,
+                            GAsyncResult *res,
+                            gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object(task));
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  g_autoptr (GVariant) repositories = NULL;
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    if (gs_plugin_android_call_list_retry (self, "GetRepositories", local_error,
+                                           fdroid_get_repositories_cb, task)) {
+      g_steal_pointer (&task);
+      return;
+    }
+    g_dbus_error_strip_remote_error (local_error);
+    g_task_return_error (task, g_steal_pointer(&local_error));
+    return;
+  }
+
+  repositories = list_reply_get_full (result, self->last_repositories,
+                                      &self->repositories_generation);
+  gs_plugin_android_snapshot_update (self, &self->last_repositories, repositories);
+  g_task_return_pointer (task, gs_plugin_android_load_repositories (self, repositories),
+                         g_object_unref);
+}
+
+static void
+fdroid_get_upgradable_cb (GObject *source_object,
+                          GAsyncResult *res,
+                          gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  g_autoptr (GVariant) entries = NULL;
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    if (gs_plugin_android_call_list_retry (self, "GetUpgradable", local_error,
+                                           fdroid_get_upgradable_cb, task)) {
+      g_steal_pointer (&task);
+      return;
+    }
+    g_dbus_error_strip_remote_error (local_error);
+    g_task_return_error (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  entries = list_reply_get_full (result, self->last_upgradable, &self->upgradable_generation);
+  self->upgradable_checked = TRUE;
+  gs_plugin_android_snapshot_update (self, &self->last_upgradable, entries);
+  g_task_return_pointer (task, gs_plugin_android_load_upgradable (self, entries),
+                         g_object_unref);
+}
+
+static void
+fdroid_get_installed_apps_cb (GObject *source_object,
+                              GAsyncResult *res,
+                              gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  g_autoptr (GVariant) entries = NULL;
+  g_autoptr (GsAppList) list = NULL;
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    if (gs_plugin_android_call_list_retry (self, "GetInstalledApps", local_error,
+                                           fdroid_get_installed_apps_cb, task)) {
+      g_steal_pointer (&task);
+      return;
+    }
+    g_dbus_error_strip_remote_error (local_error);
+    g_task_return_error (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  entries = list_reply_get_full (result, self->last_installed, &self->installed_generation);
+  if (entries == self->last_installed && self->installed_apps_valid) {
+    g_debug ("Installed apps unchanged");
+    g_task_return_pointer (task, gs_app_list_copy (self->installed_apps), g_object_unref);
+    return;
+  }
+
+  gs_plugin_android_snapshot_update (self, &self->last_installed, entries);
+  list = gs_plugin_android_load_installed (self, entries);
+
+  /* From here on, package signals keep the list up to date. Not after
+   * loading the snapshot, which may be stale until the service replied. */
+  self->installed_apps_valid = TRUE;
+
+  gs_plugin_android_prefetch_icons (self, list);
+  g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+}
+
+typedef struct {
+  GVariant **field;  /* where the reply ends up */
+  GVariant *snapshot;  /* what was served before */
+  gboolean is_updates;
+} SnapshotRevalidation;
+
+static void
+snapshot_revalidation_free (SnapshotRevalidation *revalidation)
+{
+  g_clear_pointer (&revalidation->snapshot, g_variant_unref);
+  g_free (revalidation);
+}
+
+static void
+snapshot_revalidate_cb (GObject *source_object,
+                        GAsyncResult *res,
+                        gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (source_object);
+  SnapshotRevalidation *revalidation = g_task_get_task_data (G_TASK (res));
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  list = g_task_propagate_pointer (G_TASK (res), &local_error);
+  if (list == NULL) {
+    g_debug ("Failed to revalidate snapshot: %s", local_error->message);
+  } else if (*revalidation->field != NULL &&
+             !g_variant_equal (*revalidation->field, revalidation->snapshot)) {
+    /* Only tell gnome-software when what it was shown is out of date */
+    if (revalidation->is_updates)
+      gs_plugin_updates_changed (GS_PLUGIN (self));
+    else
+      gs_plugin_reload (GS_PLUGIN (self));
+  }
+
+  if (--self->n_snapshot_revalidations == 0)
+    self->serving_snapshot = FALSE;
+}
+
+static void
+gs_plugin_android_revalidate (GsPluginAndroid *self,
+                              const gchar *method_name,
+                              GVariant **field,
+                              guint64 generation,
+                              gboolean is_updates,
+                              GAsyncReadyCallback reply_callback)
+{
+  g_autoptr (GTask) task = NULL;
+  SnapshotRevalidation *revalidation;
+
+  revalidation = g_new0 (SnapshotRevalidation, 1);
+  revalidation->field = field;
+  revalidation->snapshot = g_variant_ref (*field);
+  revalidation->is_updates = is_updates;
+
+  task = g_task_new (self, NULL, snapshot_revalidate_cb, NULL);
+  g_task_set_source_tag (task, gs_plugin_android_revalidate);
+  g_task_set_task_data (task, revalidation, (GDestroyNotify) snapshot_revalidation_free);
+
+  self->n_snapshot_revalidations++;
+  gs_plugin_android_call_list (self, method_name, generation, NULL,
+                               reply_callback, g_steal_pointer (&task));
+}
+
+/* Asks the service for every list that was served from the snapshot, in
+ * the background */
+static void
+gs_plugin_android_revalidate_snapshot (GsPluginAndroid *self)
+{
+  if (self->last_installed != NULL)
+    gs_plugin_android_revalidate (self, "GetInstalledApps", &self->last_installed,
+                                  self->installed_generation, FALSE,
+                                  fdroid_get_installed_apps_cb);
+  if (self->last_upgradable != NULL)
+    gs_plugin_android_revalidate (self, "GetUpgradable", &self->last_upgradable,
+                                  self->upgradable_generation, TRUE,
+                                  fdroid_get_upgradable_cb);
+  if (self->last_repositories != NULL)
+    gs_plugin_android_revalidate (self, "GetRepositories", &self->last_repositories,
+                                  self->repositories_generation, FALSE,
+                                  fdroid_get_repositories_cb);
+
+  if (self->n_snapshot_revalidations == 0)
+    self->serving_snapshot = FALSE;
+}
+
+/* Borrowed fields of one search result, from either reply format */
+typedef struct {
+  const gchar *id;
+  const gchar *name;
+  const gchar *summary;
+  const gchar *description;
+  const gchar *license;
+  const gchar *author;
+  const gchar *web_url;
+  const gchar *repository;
+  const gchar *version;
+  const gchar *icon_url;
+} SearchResult;
+
+typedef struct {
+  gchar *query;  /* kept to retry with the JSON method */
+  gchar *cache_key;
+  GCancellable *cancellable;  /* cancelled by the caller or when superseded */
+  GCancellable *caller_cancellable;
+  gulong cancelled_id;
+  guint max_results;  /* 0 for all results */
+  guint page_offset;  /* number of results already cached */
+  gboolean truncated;
+  gchar **words;  /* case folded keywords, for scoring */
+  GPtrArray *ranked;  /* min-heap of the best RankedResults so far */
+  guint n_candidates;
+  GVariant *reply;  /* owns the results, typed or JSON */
+  gboolean typed;
+  GVariantIter iter;  /* typed: position within reply */
+  const gchar *json;
+  gsize json_len;
+  gsize offset;  /* JSON: scan position within json */
+  JsonParser *parser;
+  GsAppList *list;
+  GHashTable *matches;  /* GsApp of list → SearchMatch */
+} SearchParseData;
+
+static void
+search_parse_data_free (SearchParseData *data)
+{
+  g_free (data->query);
+  g_free (data->cache_key);
+  if (data->caller_cancellable != NULL)
+    g_cancellable_disconnect (data->caller_cancellable, data->cancelled_id);
+  g_clear_object (&data->caller_cancellable);
+  g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->reply, g_variant_unref);
+  g_clear_object (&data->parser);
+  g_clear_object (&data->list);
+  g_clear_pointer (&data->matches, g_hash_table_unref);
+  g_strfreev (data->words);
+  g_clear_pointer (&data->ranked, g_ptr_array_unref);
+  g_free (data);
+}
+
+/* Finds the next element of a top-level JSON array without building a DOM
+ * for the whole array. Returns FALSE with @error unset once the closing
+ * bracket is reached. */
+static gboolean
+json_array_next_element (const gchar *json,
+                         gsize json_len,
+                         gsize *offset,
+                         gsize *element_start,
+                         gsize *element_len,
+                         GError **error)
+{
+  gsize i = *offset;
+  guint depth = 0;
+  gboolean in_string = FALSE;
+
+  while (i < json_len && (g_ascii_isspace (json[i]) || json[i] == ','))
+    i++;
+
+  if (i < json_len && json[i] == ']') {
+    *offset = json_len;
+    return FALSE;
+  }
+
+  *element_start = i;
+  for (; i < json_len; i++) {
+    gchar c = json[i];
+
+    if (in_string) {
+      if (c == '\\')
+        i++;
+      else if (c == '"')
+        in_string = FALSE;
+      continue;
+    }
+
+    if (c == '"') {
+      in_string = TRUE;
+    } else if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0)
+        break;
+      if (--depth == 0) {
+        i++;
+        break;
+      }
+    } else if (c == ',' && depth == 0) {
+      break;
+    }
+  }
+
+  if (i >= json_len || depth != 0 || in_string) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "Unterminated search results array");
+    return FALSE;
+  }
+
+  *element_len = i - *element_start;
+  *offset = i;
+  return TRUE;
+}
+
+static void
+search_result_init_from_json (SearchResult *result,
+                              JsonObject *app_obj)
+{
+  JsonObject *package;
+
+  result->id = json_object_get_string_member (app_obj, "id");
+  result->name = json_object_get_string_member (app_obj, "name");
+  result->summary = json_object_get_string_member (app_obj, "summary");
+  result->description = json_object_get_string_member (app_obj, "description");
+  result->license = json_object_get_string_member (app_obj, "license");
+  result->author = json_object_get_string_member (app_obj, "author");
+  result->web_url = json_object_get_string_member (app_obj, "web_url");
+  result->repository = json_object_get_string_member (app_obj, "repository");
+
+  package = json_object_get_object_member (app_obj, "package");
+  if (package) {
+    result->version = json_object_get_string_member (package, "version");
+    result->icon_url = json_object_get_string_member (package, "icon_url");
+  }
+}
+
+static void
+search_result_init_from_variant (SearchResult *result,
+                                 GVariant *child)
+{
+  g_variant_lookup (child, "id", "&s", &result->id);
+  g_variant_lookup (child, "name", "&s", &result->name);
+  g_variant_lookup (child, "summary", "&s", &result->summary);
+  g_variant_lookup (child, "description", "&s", &result->description);
+  g_variant_lookup (child, "license", "&s", &result->license);
+  g_variant_lookup (child, "author", "&s", &result->author);
+  g_variant_lookup (child, "webUrl", "&s", &result->web_url);
+  g_variant_lookup (child, "repository", "&s", &result->repository);
+  g_variant_lookup (child, "version", "&s", &result->version);
+  g_variant_lookup (child, "iconUrl", "&s", &result->icon_url);
+}
+
+/* The case folded text a search is matched against, the same fields as the
+ * service and the local index look at */
+static gchar *
+search_result_dup_text (const SearchResult *result)
+{
+  g_autofree gchar *text = NULL;
+
+  text = g_strjoin ("\n",
+                    result->id != NULL ? result->id : "",
+                    result->name != NULL ? result->name : "",
+                    result->summary != NULL ? result->summary : "",
+                    result->author != NULL ? result->author : "",
+                    result->description != NULL ? result->description : "",
+                    NULL);
+
+  return g_utf8_casefold (text, -1);
+}
+
+/* Sets the details which are only needed on the details page; marks them
+ * as loaded even if the store has none, so they aren't asked for again */
+static void
+app_set_details (GsApp *app,
+                 const SearchResult *result)
+{
+  gs_app_set_description (app, GS_APP_QUALITY_NORMAL, result->description);
+  gs_app_set_license (app, GS_APP_QUALITY_NORMAL, result->license);
+  gs_app_set_developer_name (app, result->author);
+  gs_app_set_url (app, AS_URL_KIND_HOMEPAGE, result->web_url);
+
+  if (gs_app_get_metadata_item (app, "android::details-loaded") == NULL)
+    gs_app_set_metadata (app, "android::details-loaded", "true");
+}
+
+/* Returns NULL for results without a package id. Unless @with_details is
+ * set, only what a search result row shows is set and the rest is left to
+ * gs_plugin_android_refine_async(). */
+static GsApp *
+gs_plugin_android_app_from_search_result (GsPluginAndroid *self,
+                                          GHashTable *installed_package_names,
+                                          const SearchResult *result,
+                                          gboolean with_details)
+{
+  GsApp *app;
+  gboolean is_installed;
+  GPtrArray *icons;
+
+  if (result->id == NULL)
+    return NULL;
+
+  is_installed = g_hash_table_contains (installed_package_names, result->id);
+
+  app = gs_plugin_android_get_app (self, result->id, result->id);
+  app_replace_metadata (app, "android-store::repository", result->repository);
+
+  gs_app_set_name (app, GS_APP_QUALITY_NORMAL, result->name);
+  gs_app_set_summary (app, GS_APP_QUALITY_NORMAL, result->summary);
+  if (with_details)
+    app_set_details (app, result);
+
+  /* The catalog version is the one available, not the installed one */
+  if (!is_installed)
+    gs_app_set_version (app, result->version);
+
+  icons = gs_app_get_icons (app);
+  if (result->icon_url != NULL && !app_has_cached_icons (app)) {
+      if (!g_str_has_prefix (result->icon_url, "http://") && !g_str_has_prefix (result->icon_url, "https://")) {
+          g_debug ("App '%s' has invalid icon URL: %s", result->name, result->icon_url);
+      } else {
+          app_replace_metadata (app, "android::icon-url", result->icon_url);
+
+          /* Until refine_async has cached it, the icons plugin downloads
+           * the remote icon */
+          if (!app_add_cached_icons (app, result->icon_url) &&
+              (icons == NULL || icons->len == 0)) {
+              g_autoptr (GIcon) icon = gs_remote_icon_new (result->icon_url);
+              gs_app_add_icon (app, icon);
+          }
+      }
+  }
+
+  app_update_state (app, is_installed ? GS_APP_STATE_INSTALLED : GS_APP_STATE_AVAILABLE);
+
+  return app;
+}
+
+/* Weights of where a keyword matched, summed over all keywords */
+#define SEARCH_SCORE_ID_EXACT 100
+#define SEARCH_SCORE_NAME_EXACT 80
+#define SEARCH_SCORE_NAME_PREFIX 50
+#define SEARCH_SCORE_NAME 30
+#define SEARCH_SCORE_ID 20
+#define SEARCH_SCORE_SUMMARY 10
+#define SEARCH_SCORE_DESCRIPTION 2
+
+static guint
+search_result_score (const SearchResult *result,
+                     gchar **words)
+{
+  g_autofree gchar *id = result->id != NULL ? g_utf8_casefold (result->id, -1) : NULL;
+  g_autofree gchar *name = result->name != NULL ? g_utf8_casefold (result->name, -1) : NULL;
+  g_autofree gchar *summary = result->summary != NULL ? g_utf8_casefold (result->summary, -1) : NULL;
+  g_autofree gchar *description = NULL;
+  guint score = 0;
+
+  for (guint i = 0; words[i] != NULL; i++) {
+    const gchar *word = words[i];
+    guint word_score = 0;
+
+    if (id != NULL && strcmp (id, word) == 0)
+      word_score += SEARCH_SCORE_ID_EXACT;
+    else if (id != NULL && strstr (id, word) != NULL)
+      word_score += SEARCH_SCORE_ID;
+
+    if (name != NULL && strcmp (name, word) == 0)
+      word_score += SEARCH_SCORE_NAME_EXACT;
+    else if (name != NULL && g_str_has_prefix (name, word))
+      word_score += SEARCH_SCORE_NAME_PREFIX;
+    else if (name != NULL && strstr (name, word) != NULL)
+      word_score += SEARCH_SCORE_NAME;
+
+    if (summary != NULL && strstr (summary, word) != NULL)
+      word_score += SEARCH_SCORE_SUMMARY;
+
+    /* Descriptions are long, so only look at them as a last resort */
+    if (word_score == 0 && result->description != NULL) {
+      if (description == NULL)
+        description = g_utf8_casefold (result->description, -1);
+      if (strstr (description, word) != NULL)
+        word_score += SEARCH_SCORE_DESCRIPTION;
+    }
+
+    score += word_score;
+  }
+
+  return score;
+}
+
+/* Scores a search_result_dup_text() the way search_result_score() scores
+ * the result it was made from */
+static guint
+search_text_score (const gchar *text,
+                   gchar **words)
+{
+  g_auto (GStrv) fields = g_strsplit (text, "\n", 5);
+  SearchResult result = { NULL, };
+
+  if (g_strv_length (fields) != 5)
+    return 0;
+
+  result.id = fields[0];
+  result.name = fields[1];
+  result.summary = fields[2];
+  result.author = fields[3];
+  result.description = fields[4];
+
+  return search_result_score (&result, words);
+}
+
+/* A scored result which has not been turned into a GsApp yet */
+typedef struct {
+  guint score;
+  guint position;  /* order in the reply, to break ties */
+  SearchResult fields;  /* borrows from variant or node */
+  GVariant *variant;
+  JsonNode *node;
+} RankedResult;
+
+static void
+ranked_result_free (RankedResult *ranked)
+{
+  g_clear_pointer (&ranked->variant, g_variant_unref);
+  g_clear_pointer (&ranked->node, json_node_unref);
+  g_free (ranked);
+}
+
+static gboolean
+ranked_result_is_worse (const RankedResult *a,
+                        const RankedResult *b)
+{
+  return a->score < b->score ||
+         (a->score == b->score && a->position > b->position);
+}
+
+static gint
+compare_ranked_results (gconstpointer a,
+                        gconstpointer b)
+{
+  const RankedResult *ranked_a = *(const RankedResult **) a;
+  const RankedResult *ranked_b = *(const RankedResult **) b;
+
+  if (ranked_result_is_worse (ranked_a, ranked_b))
+    return 1;
+  if (ranked_result_is_worse (ranked_b, ranked_a))
+    return -1;
+  return 0;
+}
+
+static void
+ranked_results_sift_down (GPtrArray *heap,
+                          guint i)
+{
+  for (;;) {
+    guint left = 2 * i + 1;
+    guint right = left + 1;
+    guint worst = i;
+    gpointer tmp;
+
+    if (left < heap->len &&
+        ranked_result_is_worse (g_ptr_array_index (heap, left), g_ptr_array_index (heap, worst)))
+      worst = left;
+    if (right < heap->len &&
+        ranked_result_is_worse (g_ptr_array_index (heap, right), g_ptr_array_index (heap, worst)))
+      worst = right;
+    if (worst == i)
+      return;
+
+    tmp = heap->pdata[i];
+    heap->pdata[i] = heap->pdata[worst];
+    heap->pdata[worst] = tmp;
+    i = worst;
+  }
+}
+
+/* Keeps the best @max_results results seen so far in @heap, with the worst
+ * at the root so it can be replaced cheaply. Takes ownership of @ranked. */
+static void
+ranked_results_push (GPtrArray *heap,
+                     guint max_results,
+                     RankedResult *ranked)
+{
+  guint i;
+
+  if (max_results != 0 && heap->len >= max_results) {
+    if (!ranked_result_is_worse (g_ptr_array_index (heap, 0), ranked)) {
+      ranked_result_free (ranked);
+      return;
+    }
+    ranked_result_free (g_ptr_array_index (heap, 0));
+    heap->pdata[0] = ranked;
+    ranked_results_sift_down (heap, 0);
+    return;
+  }
+
+  g_ptr_array_add (heap, ranked);
+  for (i = heap->len - 1; i > 0; i = (i - 1) / 2) {
+    guint parent = (i - 1) / 2;
+    gpointer tmp;
+
+    if (!ranked_result_is_worse (g_ptr_array_index (heap, i), g_ptr_array_index (heap, parent)))
+      break;
+    tmp = heap->pdata[i];
+    heap->pdata[i] = heap->pdata[parent];
+    heap->pdata[parent] = tmp;
+  }
+}
+
+/* Only the results which made it into the heap are turned into GsApps. The
+ * apps are shared, so this must run on the main thread. */
+static void
+gs_plugin_android_add_ranked_results (GsPluginAndroid *self,
+                                      GHashTable *installed_package_names,
+                                      GPtrArray *heap,
+                                      gboolean with_details,
+                                      GsAppList *list,
+                                      GHashTable *matches)
+{
+  g_ptr_array_sort (heap, compare_ranked_results);
+
+  for (guint i = 0; i < heap->len; i++) {
+    RankedResult *ranked = g_ptr_array_index (heap, i);
+    g_autoptr (GsApp) app = NULL;
+
+    app = gs_plugin_android_app_from_search_result (self, installed_package_names,
+                                                    &ranked->fields, with_details);
+    if (app == NULL)
+      continue;
+
+    gs_app_set_match_value (app, ranked->score);
+    gs_app_list_add (list, app);
+    g_hash_table_insert (matches, app,
+                         search_match_new (search_result_dup_text (&ranked->fields), ranked->score));
+  }
+}
+
+/* Gets the next result from either reply format. Returns NULL with @error
+ * unset once all results have been consumed. */
+static RankedResult *
+search_parse_data_next (SearchParseData *data,
+                        GError **error)
+{
+  g_autoptr (JsonNode) root = NULL;
+  RankedResult *ranked;
+  gsize element_start = 0;
+  gsize element_len = 0;
+
+  if (data->typed) {
+    GVariant *child = g_variant_iter_next_value (&data->iter);
+
+    if (child == NULL)
+      return NULL;
+
+    ranked = g_new0 (RankedResult, 1);
+    ranked->variant = child;
+    search_result_init_from_variant (&ranked->fields, child);
+    return ranked;
+  }
+
+  do {
+    g_clear_pointer (&root, json_node_unref);
+
+    if (!json_array_next_element (data->json, data->json_len, &data->offset,
+                                  &element_start, &element_len, error))
+      return NULL;
+
+    if (!json_parser_load_from_data (data->parser, data->json + element_start,
+                                     element_len, error))
+      return NULL;
+
+    root = json_parser_steal_root (data->parser);
+    if (root == NULL || !JSON_NODE_HOLDS_OBJECT (root))
+      g_debug ("Skipping search result which is not an object");
+  } while (root == NULL || !JSON_NODE_HOLDS_OBJECT (root));
+
+  ranked = g_new0 (RankedResult, 1);
+  ranked->node = g_steal_pointer (&root);
+  search_result_init_from_json (&ranked->fields, json_node_get_object (ranked->node));
+  return ranked;
+}
+
+static void
+search_cancelled_cb (GCancellable *cancellable,
+                     gpointer user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Completes a service search, with either @error or the parsed results */
+static void
+fdroid_search_return (GTask *task,
+                      GError *error)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  SearchParseData *data = g_task_get_task_data (task);
+
+  if (self->search_cancellable == data->cancellable) {
+    g_clear_object (&self->search_cancellable);
+    g_clear_pointer (&self->search_query, g_free);
+  }
+
+  if (error != NULL) {
+    g_dbus_error_strip_remote_error (error);
+    g_task_return_error (task, error);
+    return;
+  }
+
+  gs_plugin_android_search_cache_add (self, data->cache_key, data->list, data->matches,
+                                      data->truncated);
+  search_matches_apply (data->matches, data->list);
+  gs_plugin_android_prefetch_icons (self, data->list);
+  g_task_return_pointer (task, g_steal_pointer (&data->list), g_object_unref);
+}
+
+/* Runs in a worker thread, so only the fields of @task_data are touched:
+ * results are parsed, scored and ranked here, and only the winners are
+ * turned into GsApps back on the main thread */
+static void
+fdroid_search_parse_thread_cb (GTask *task,
+                               gpointer source_object,
+                               gpointer task_data,
+                               GCancellable *cancellable)
+{
+  SearchParseData *data = task_data;
+  g_autoptr (GError) local_error = NULL;
+  guint n_wanted = data->max_results != 0 ? data->max_results - data->page_offset : 0;
+  RankedResult *ranked;
+
+  /* Every result is scored, but only the best ones asked for are built */
+  while ((ranked = search_parse_data_next (data, &local_error)) != NULL) {
+    ranked->score = search_result_score (&ranked->fields, data->words);
+    ranked->position = data->n_candidates++;
+    ranked_results_push (data->ranked, n_wanted, ranked);
+
+    /* Also stops parsing results of a superseded search */
+    if (g_task_return_error_if_cancelled (task))
+      return;
+  }
+
+  if (local_error != NULL) {
+    g_task_return_error (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  if (n_wanted != 0 && data->n_candidates > n_wanted)
+    data->truncated = TRUE;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+fdroid_search_parse_cb (GObject *source_object,
+                        GAsyncResult *res,
+                        gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  SearchParseData *data = g_task_get_task_data (task);
+  g_autoptr (GError) local_error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (res), &local_error)) {
+    fdroid_search_return (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  gs_plugin_android_add_ranked_results (self, self->installed_package_names,
+                                        data->ranked, self->app_details_unsupported,
+                                        data->list, data->matches);
+
+  fdroid_search_return (task, NULL);
+}
+
+/* Decoding and ranking the reply happens in a worker thread so large
+ * replies don't block the UI; only the best results are handed back */
+static void
+fdroid_search_start_parse (GTask *task)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  SearchParseData *data = g_task_get_task_data (task);
+  g_autoptr (GTask) parse_task = NULL;
+
+  parse_task = g_task_new (self, data->cancellable, fdroid_search_parse_cb, g_object_ref (task));
+  g_task_set_source_tag (parse_task, fdroid_search_start_parse);
+  g_task_set_task_data (parse_task, data, NULL);
+  g_task_run_in_thread (parse_task, fdroid_search_parse_thread_cb);
+}
+
+static void
+fdroid_search_cb (GObject *source_object,
+                  GAsyncResult *res,
+                  gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  SearchParseData *data = g_task_get_task_data (task);
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    fdroid_search_return (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  data->reply = g_steal_pointer (&result);
+  g_variant_get (data->reply, "(&s)", &data->json);
+  data->json_len = strlen (data->json);
+  data->parser = json_parser_new ();
+
+  /* Only the opening bracket is checked up front */
+  while (data->offset < data->json_len && g_ascii_isspace (data->json[data->offset]))
+    data->offset++;
+  if (data->offset >= data->json_len || data->json[data->offset] != '[') {
+    fdroid_search_return (task, g_error_new_literal (G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                                     "Search results are not a JSON array"));
+    return;
+  }
+  data->offset++;
+
+  fdroid_search_start_parse (task);
+}
+
+static void
+fdroid_search_apps_cb (GObject *source_object,
+                       GAsyncResult *res,
+                       gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  SearchParseData *data = g_task_get_task_data (task);
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    /* Older services only have the JSON based Search method */
+    if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+      g_debug ("SearchApps not supported by service, falling back to Search");
+      self->search_apps_unsupported = TRUE;
+
+      /* Search can't skip the results we already have */
+      g_clear_object (&data->list);
+      g_clear_pointer (&data->matches, g_hash_table_unref);
+      data->list = gs_app_list_new ();
+      data->matches = search_matches_new ();
+      data->page_offset = 0;
+      data->truncated = FALSE;
+
+      g_dbus_proxy_call (self->fdroid_proxy,
+                         "Search",
+                         g_variant_new ("(s)", data->query),
+                         G_DBUS_CALL_FLAGS_NONE,
+                         -1,
+                         data->cancellable,
+                         fdroid_search_cb,
+                         g_steal_pointer (&task));
+      return;
+    }
+
+    fdroid_search_return (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  data->reply = g_variant_get_child_value (result, 0);
+  data->typed = TRUE;
+  g_variant_iter_init (&data->iter, data->reply);
+
+  /* The service stops at the page size, so a full page may have more */
+  if (data->max_results != 0 &&
+      g_variant_n_children (data->reply) >= data->max_results - data->page_offset)
+    data->truncated = TRUE;
+
+  fdroid_search_start_parse (task);
+}
+
+static GsAppList *
+gs_plugin_android_search_local (GsPluginAndroid *self,
+                                const gchar * const *keywords,
+                                const gchar *cache_key,
+                                guint max_results,
+                                GHashTable *matches,
+                                gboolean *truncated)
+{
+  g_autoptr (GPtrArray) entries = NULL;
+  g_autoptr (GPtrArray) heap = NULL;
+  g_auto (GStrv) words = g_strsplit (cache_key, " ", -1);
+  GsAppList *list = gs_app_list_new ();
+
+  entries = gs_android_search_index_query (self->search_index, keywords);
+  heap = g_ptr_array_new_with_free_func ((GDestroyNotify) ranked_result_free);
+
+  for (guint i = 0; i < entries->len; i++) {
+    RankedResult *ranked = g_new0 (RankedResult, 1);
+
+    ranked->variant = g_variant_ref (g_ptr_array_index (entries, i));
+    ranked->position = i;
+    search_result_init_from_variant (&ranked->fields, ranked->variant);
+    ranked->score = search_result_score (&ranked->fields, words);
+    ranked_results_push (heap, max_results, ranked);
+  }
+
+  gs_plugin_android_add_ranked_results (self, self->installed_package_names, heap,
+                                        self->app_details_unsupported, list, matches);
+  *truncated = max_results != 0 && entries->len > max_results;
+
+  return list;
+}
+
+static GsAppList *
+gs_plugin_android_list_apps_finish (GsPlugin *plugin,
+                                    GAsyncResult *result,
+                                    GError **error)
+{
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+gs_plugin_android_list_apps_async (GsPlugin *plugin,
+                                   GsAppQuery *query,
+                                   GsPluginListAppsFlags flags,
+                                   GCancellable *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
+  g_autoptr (GTask) task = NULL;
+  GsAppQueryTristate is_installed = GS_APP_QUERY_TRISTATE_UNSET;
+  GsAppQueryTristate is_source = GS_APP_QUERY_TRISTATE_UNSET;
+  GsAppQueryTristate is_for_updates = GS_APP_QUERY_TRISTATE_UNSET;
+  const gchar * const *keywords = NULL;
+  guint max_results = 0;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_list_apps_async);
+
+  if (query != NULL) {
+    is_source = gs_app_query_get_is_source (query);
+    is_installed = gs_app_query_get_is_installed (query);
+    is_for_updates = gs_app_query_get_is_for_update (query);
+    keywords = gs_app_query_get_keywords (query);
+    max_results = gs_app_query_get_max_results (query);
+  }
+
+  /* Currently only support one query type at a time */
+  if (gs_app_query_get_n_properties_set (query) != 1 ||
+      is_source == GS_APP_QUERY_TRISTATE_FALSE ||
+      is_installed == GS_APP_QUERY_TRISTATE_FALSE ||
+      is_for_updates == GS_APP_QUERY_TRISTATE_FALSE) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                             "Unsupported query");
+    return;
+  }
+
+  if (is_source == GS_APP_QUERY_TRISTATE_TRUE) {
+    if (self->serving_snapshot && self->last_repositories != NULL) {
+      g_debug ("Listing repositories from snapshot");
+      g_task_return_pointer (task,
+                             gs_plugin_android_load_repositories (self, self->last_repositories),
+                             g_object_unref);
+      return;
+    }
+
+    g_debug ("Listing repositories");
+    gs_plugin_android_call_list (self, "GetRepositories", self->repositories_generation,
+                                 cancellable, fdroid_get_repositories_cb,
+                                 g_steal_pointer (&task));
+  } else if (is_installed == GS_APP_QUERY_TRISTATE_TRUE) {
+    if (self->installed_apps_valid) {
+      g_debug ("Listing tracked installed apps");
+      g_task_return_pointer (task, gs_app_list_copy (self->installed_apps), g_object_unref);
+      return;
+    }
+
+    if (self->serving_snapshot && self->last_installed != NULL) {
+      g_debug ("Listing installed apps from snapshot");
+      g_task_return_pointer (task, gs_app_list_copy (self->installed_apps), g_object_unref);
+      return;
+    }
+
+    g_debug ("Listing installed apps");
+    gs_plugin_android_call_list (self, "GetInstalledApps", self->installed_generation,
+                                 cancellable, fdroid_get_installed_apps_cb,
+                                 g_steal_pointer (&task));
+  } else if (is_for_updates == GS_APP_QUERY_TRISTATE_TRUE) {
+    if (self->serving_snapshot && self->last_upgradable != NULL) {
+      g_debug ("Listing updates from snapshot");
+      g_task_return_pointer (task, gs_plugin_android_list_updatable (self), g_object_unref);
+      return;
+    }
+
+    /* Between refreshes the last GetUpgradable reply stands, less the
+     * updates installed since */
+    if (self->upgradable_checked && self->installed_apps_valid) {
+      g_debug ("Listing updates from local versions");
+      g_task_return_pointer (task, gs_plugin_android_compute_upgradable (self), g_object_unref);
+      return;
+    }
+
+    g_debug ("Listing updates");
+    gs_plugin_android_call_list (self, "GetUpgradable", self->upgradable_generation,
+                                 cancellable, fdroid_get_upgradable_cb,
+                                 g_steal_pointer (&task));
+  } else if (keywords != NULL) {
+    g_autofree gchar *cache_key = search_cache_key_new (keywords);
+    g_autoptr (GsAppList) list = NULL;
+    g_autoptr (GHashTable) matches = NULL;
+    SearchCacheEntry *entry;
+    SearchParseData *data;
+
+    entry = gs_plugin_android_search_cache_lookup (self, cache_key);
+    if (entry != NULL &&
+        (!entry->truncated ||
+         (max_results != 0 && gs_app_list_length (entry->list) >= max_results))) {
+      g_debug ("Using cached results for search: %s", cache_key);
+      list = app_list_copy_first (entry->list, max_results);
+      search_matches_apply (entry->matches, list);
+      g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+      return;
+    }
+
+    if (self->search_index != NULL) {
+      gboolean truncated = FALSE;
+
+      g_debug ("Searching local index for apps");
+      matches = search_matches_new ();
+      list = gs_plugin_android_search_local (self, keywords, cache_key,
+                                             max_results, matches, &truncated);
+      gs_plugin_android_search_cache_add (self, cache_key, list, matches, truncated);
+      gs_plugin_android_prefetch_icons (self, list);
+      g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+      return;
+    }
+
+    list = entry == NULL ? gs_plugin_android_search_cache_refine (self, cache_key, &matches) : NULL;
+    if (list != NULL) {
+      gs_plugin_android_search_cache_add (self, cache_key, list, matches, FALSE);
+      search_matches_apply (matches, list);
+      g_task_return_pointer (task, app_list_copy_first (list, max_results),
+                             g_object_unref);
+      return;
+    }
+
+    data = g_new0 (SearchParseData, 1);
+    data->query = g_strjoinv (" ", (gchar **) keywords);
+    data->words = g_strsplit (cache_key, " ", -1);
+    data->cache_key = g_steal_pointer (&cache_key);
+    data->max_results = max_results;
+    data->ranked = g_ptr_array_new_with_free_func ((GDestroyNotify) ranked_result_free);
+
+    /* A truncated cached search only needs its next page fetching */
+    if (entry != NULL && !self->search_apps_unsupported) {
+      data->list = gs_app_list_copy (entry->list);
+      data->matches = search_matches_copy (entry->matches);
+      data->page_offset = gs_app_list_length (entry->list);
+    } else {
+      data->list = gs_app_list_new ();
+      data->matches = search_matches_new ();
+    }
+    data->cancellable = g_cancellable_new ();
+    if (cancellable != NULL) {
+      data->caller_cancellable = g_object_ref (cancellable);
+      data->cancelled_id = g_cancellable_connect (cancellable,
+                                                  G_CALLBACK (search_cancelled_cb),
+                                                  data->cancellable, NULL);
+    }
+    g_task_set_task_data (task, data, (GDestroyNotify) search_parse_data_free);
+    g_debug ("Searching for apps: %s", data->query);
+
+    /* Only the newest search matters while the user is typing */
+    if (self->search_cancellable != NULL) {
+      g_debug ("Cancelling superseded search: %s", self->search_query);
+      g_cancellable_cancel (self->search_cancellable);
+
+      /* Older services don't support this and just finish the search */
+      g_dbus_proxy_call (self->fdroid_proxy,
+                         "CancelSearch",
+                         g_variant_new ("(s)", self->search_query),
+                         G_DBUS_CALL_FLAGS_NONE,
+                         -1,
+                         NULL,
+                         NULL,
+                         NULL);
+    }
+    g_set_object (&self->search_cancellable, data->cancellable);
+    g_free (self->search_query);
+    self->search_query = g_strdup (data->query);
+
+    /* Prefer the typed reply, which needs no JSON round trip and can be
+     * limited to the requested page */
+    g_dbus_proxy_call (self->fdroid_proxy,
+                       self->search_apps_unsupported ? "Search" : "SearchApps",
+                       self->search_apps_unsupported ?
+                       g_variant_new ("(s)", data->query) :
+                       g_variant_new ("(suu)", data->query, data->page_offset,
+                                      max_results != 0 ? max_results - data->page_offset : 0),
+                       G_DBUS_CALL_FLAGS_NONE,
+                       -1,
+                       data->cancellable,
+                       self->search_apps_unsupported ? fdroid_search_cb : fdroid_search_apps_cb,
+                       g_steal_pointer (&task));
+  } else {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                             "Unsupported query type");
+  }
+}
+
+static void
+fdroid_remove_repository_cb (GObject *source_object,
+                             GAsyncResult *res,
+                             gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  GsApp *app = g_task_get_task_data (task);
+
+  g_debug ("Removing F-Droid repository: %s", gs_app_get_unique_id (app));
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    gs_app_set_state_recover (app);
+    g_dbus_error_strip_remote_error (local_error);
+    g_task_return_error (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
+  g_task_return_boolean (task, TRUE);
+}
+
+static gboolean
+gs_plugin_android_remove_repository_finish (GsPlugin *plugin,
+                                            GAsyncResult *result,
+                                            GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+gs_plugin_android_remove_repository_async (GsPlugin *plugin,
+                                           GsApp *repo,
+                                           GsPluginManageRepositoryFlags flags,
+                                           GCancellable *cancellable,
+                                           GAsyncReadyCallback callback,
+                                           gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_remove_repository_async);
+
+  g_assert (gs_app_get_kind (repo) == AS_COMPONENT_KIND_REPOSITORY);
+  g_task_set_task_data (task, g_object_ref (repo), g_object_unref);
+
+  gs_app_set_state (repo, GS_APP_STATE_REMOVING);
+
+  g_dbus_proxy_call (self->fdroid_proxy,
+                     "RemoveRepository",
+                     g_variant_new ("(s)", gs_app_get_id (repo)),
+                     G_DBUS_CALL_FLAGS_NONE,
+                     -1,
+                     cancellable,
+                     fdroid_remove_repository_cb,
+                     g_steal_pointer (&task));
+}
+
+static void
+fdroid_uninstall_app_cb (GObject *source_object,
+                         GAsyncResult *res,
+                         gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  GsApp *app = g_task_get_task_data (task);
+  const gchar *package_name;
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL) {
+    gs_app_set_state_recover (app);
+    g_dbus_error_strip_remote_error (local_error);
+    g_task_return_error (task, g_steal_pointer (&local_error));
+    return;
+  }
+
+  gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
+  package_name = gs_app_get_metadata_item (app, "android::package-name");
+  if (package_name != NULL)
+    gs_plugin_android_remove_installed_app (self, package_name);
+  gs_plugin_android_search_cache_clear (self);
+  gs_plugin_updates_changed (GS_PLUGIN (self));
+  g_task_return_boolean (task, TRUE);
+}
+
+static gboolean
+gs_plugin_android_uninstall_apps_finish (GsPlugin *plugin,
+                                         GAsyncResult *result,
+                                         GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+gs_plugin_android_uninstall_apps_async (GsPlugin *plugin,
+                                        GsAppList *list,
+                                        GsPluginUninstallAppsFlags flags,
+                                        GsPluginProgressCallback progress_callback,
+                                        gpointer progress_user_data,
+                                        GsPluginAppNeedsUserActionCallback app_needs_user_action_callback,
+                                        gpointer app_needs_user_action_data,
+                                        GCancellable *cancellable,
+                                        GAsyncReadyCallback callback,
+                                        gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (GsAppList) uninstall_list = gs_app_list_new ();
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_uninstall_apps_async);
+
+  for (guint i = 0; i < gs_app_list_length (list); i++) {
+    GsApp *app = gs_app_list_index (list, i);
+
+    g_assert (gs_app_get_kind (app) != AS_COMPONENT_KIND_REPOSITORY);
+    g_debug ("Considering app %s for uninstallation", gs_app_get_unique_id (app));
+
+    if (!gs_app_has_management_plugin (app, plugin)) {
+      g_debug ("App %s is not managed by us, not uninstalling", gs_app_get_unique_id (app));
+      continue;
+    }
+
+    gs_app_list_add (uninstall_list, app);
+    gs_app_set_state (app, GS_APP_STATE_REMOVING);
+  }
+
+  if (gs_app_list_length (uninstall_list) != 1) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                             "Can only uninstall one app at a time");
+    return;
+  }
+
+  g_task_set_task_data (task, g_object_ref (gs_app_list_index (uninstall_list, 0)), g_object_unref);
+
+  g_dbus_proxy_call (self->fdroid_proxy,
+                     "UninstallApp",
+                     g_variant_new ("(s)", gs_app_get_metadata_item (gs_app_list_index (uninstall_list, 0), "android::package-name")),
+                     G_DBUS_CALL_FLAGS_NONE,
+                     -1,
+                     cancellable,
+                     fdroid_uninstall_app_cb,
+                     g_steal_pointer (&task));
+}
+
+static gboolean
+gs_plugin_android_filter_desktop_file_cb (GsPlugin *plugin,
+                                          GsApp *app,
+                                          const gchar *filename,
+                                          GKeyFile *key_file,
+                                          gpointer user_data)
+{
+  return strstr (filename, "/snapd/") == NULL &&
+         strstr (filename, "/snap/") == NULL &&
+         strstr (filename, "/flatpak/") == NULL &&
+         g_key_file_has_group (key_file, "Desktop Entry") &&
+         !g_key_file_has_key (key_file, "Desktop Entry", "X-Flatpak", NULL) &&
+         !g_key_file_has_key (key_file, "Desktop Entry", "X-SnapInstanceName", NULL);
+}
+
+static gboolean
+gs_plugin_android_launch_finish (GsPlugin *plugin,
+                                 GAsyncResult *result,
+                                 GError **error)
+{
+  return gs_plugin_app_launch_filtered_finish (plugin, result, error);
+}
+
+static void
+gs_plugin_android_launch_async (GsPlugin *plugin,
+                                GsApp *app,
+                                GsPluginLaunchFlags flags,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+
+{
+  gs_plugin_app_launch_filtered_async (plugin, app, flags, gs_plugin_android_filter_desktop_file_cb, NULL, cancellable, callback, user_data);
+}
+
+/* Least time between two calls of a job's progress callback */
+#define JOB_PROGRESS_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+/* Downloads running at once in a job, unless overridden by
+ * GS_PLUGIN_ANDROID_DOWNLOAD_JOBS */
+#define JOB_MAX_DOWNLOADS 3
+#define JOB_MAX_DOWNLOADS_LIMIT 8
+
+/* Tries per package before a job gives up on it */
+#define JOB_MAX_ATTEMPTS 2
+
+/* Installs and updates of several apps are pipelined: up to max_downloads
+ * packages download while the previously downloaded one is installed into
+ * the container */
+typedef struct {
+  GsAppList *list;
+  gboolean install;  /* Installing new apps rather than updating */
+  gboolean download_only;  /* NO_APPLY */
+  GHashTable *pending;  /* package name → GsApp of list not done yet */
+  GQueue download_queue;  /* GsApp not downloaded yet, in list order */
+  GQueue apply_queue;  /* GsApp downloaded, waiting to be installed */
+  GPtrArray *fallback;  /* GsApp left to Install or UpgradePackages */
+  GHashTable *attempts;  /* package name → tries so far, after the first */
+  GHashTable *failed;  /* package names with a "failed" progress signal */
+  guint n_failed;
+  guint n_downloads;
+  gboolean applying;
+  gboolean fallback_running;  /* An Install or UpgradePackages call is running */
+  GError *error;  /* First failure, returned once everything is done */
+  GsPluginProgressCallback progress_callback;
+  gpointer progress_user_data;
+  guint progress;
+  gint64 progress_time;
+} PackageJob;
+
+static PackageJob *
+package_job_new (GsAppList *list,
+                 gboolean install,
+                 gboolean download_only,
+                 GsPluginProgressCallback progress_callback,
+                 gpointer progress_user_data)
+{
+  PackageJob *data = g_new0 (PackageJob, 1);
+
+  data->list = list != NULL ? g_object_ref (list) : gs_app_list_new ();
+  data->install = install;
+  data->download_only = download_only;
+  data->pending = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&data->download_queue);
+  g_queue_init (&data->apply_queue);
+  data->fallback = g_ptr_array_new ();
+  data->attempts = g_hash_table_new (g_str_hash, g_str_equal);
+  data->failed = g_hash_table_new (g_str_hash, g_str_equal);
+  data->progress_callback = progress_callback;
+  data->progress_user_data = progress_user_data;
+
+  return data;
+}
+
+static void
+package_job_free (PackageJob *data)
+{
+  g_clear_object (&data->list);
+  g_clear_pointer (&data->pending, g_hash_table_unref);
+  g_queue_clear (&data->download_queue);
+  g_queue_clear (&data->apply_queue);
+  g_clear_pointer (&data->fallback, g_ptr_array_unref);
+  g_clear_pointer (&data->attempts, g_hash_table_unref);
+  g_clear_pointer (&data->failed, g_hash_table_unref);
+  g_clear_error (&data->error);
+  g_free (data);
+}
+
+typedef struct {
+  GTask *task;  /* owned */
+  GsApp *app;  /* owned */
+} PackageJobOp;
+
+static PackageJobOp *
+package_job_op_new (GTask *task,
+                    GsApp *app)
+{
+  PackageJobOp *op = g_new0 (PackageJobOp, 1);
+
+  op->task = g_object_ref (task);
+  op->app = g_object_ref (app);
+
+  return op;
+}
+
+static void
+package_job_op_free (PackageJobOp *op)
+{
+  g_clear_object (&op->task);
+  g_clear_object (&op->app);
+  g_free (op);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PackageJobOp, package_job_op_free)
+
+static void
+gs_plugin_android_job_report_progress (GsPluginAndroid *self,
+                                       PackageJob *data)
+{
+  guint n_apps = gs_app_list_length (data->list);
+  guint total = 0;
+  guint progress;
+  gint64 now;
+
+  if (data->progress_callback == NULL || n_apps == 0)
+    return;
+
+  for (guint i = 0; i < n_apps; i++) {
+    GsApp *app = gs_app_list_index (data->list, i);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+    guint app_progress = gs_app_get_progress (app);
+
+    if (package_name == NULL || !g_hash_table_contains (data->pending, package_name))
+      total += 100;
+    else if (app_progress != GS_APP_PROGRESS_UNKNOWN)
+      total += MIN (app_progress, 100);
+  }
+
+  /* Progress signals can come in much faster than the UI redraws */
+  progress = total / n_apps;
+  now = g_get_monotonic_time ();
+  if (progress == data->progress ||
+      (progress < 100 && now - data->progress_time < JOB_PROGRESS_INTERVAL))
+    return;
+
+  data->progress = progress;
+  data->progress_time = now;
+  data->progress_callback (GS_PLUGIN (self), progress, data->progress_user_data);
 }
 
 static void
-fdroid_search_cb (GObject *source_object,
-                  GAsyncResult *res,
-                  gpointer user_data)
+gs_plugin_android_job_finish_app (GsPluginAndroid *self,
+                                  PackageJob *data,
+                                  GsApp *app,
+                                  gboolean success)
 {
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  g_autoptr (GsAppList) list = gs_app_list_new ();
-  g_autoptr (JsonParser) parser = NULL;
-  JsonNode *root;
-  JsonArray *array;
-  const gchar *json_data;
+  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
 
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
-  if (result == NULL) {
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
+  /* A download-only pass leaves the apps' state alone */
+  if (data->download_only) {
+    g_debug ("%s %s", success ? "Downloaded" : "Failed to download", package_name);
+  } else if (success && data->install) {
+    gs_app_set_state (app, GS_APP_STATE_INSTALLED);
+    gs_app_list_add (self->installed_apps, app);
+    g_hash_table_add (self->installed_package_names, g_strdup (package_name));
+    gs_plugin_android_unstage (self, package_name);
+    gs_plugin_android_search_cache_clear (self);
+    g_debug ("Installed app: %s", gs_app_get_unique_id (app));
+  } else if (success) {
+    gs_app_set_state (app, GS_APP_STATE_INSTALLED);
+    g_hash_table_remove (self->updatable_apps, package_name);
+    gs_plugin_android_unstage (self, package_name);
+    g_debug ("Updated app: %s", gs_app_get_unique_id (app));
+  } else {
+    gs_app_set_state_recover (app);
   }
+  gs_app_set_progress (app, GS_APP_PROGRESS_UNKNOWN);
 
-  g_variant_get (result, "(s)", &json_data);
-  parser = json_parser_new ();
-  if (!json_parser_load_from_data (parser, json_data, -1, &local_error)) {
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
-  }
+  g_hash_table_remove (data->pending, package_name);
+}
 
-  root = json_parser_get_root (parser);
-  array = json_node_get_array (root);
+/* Handles a PackageProgress signal. @phase is "downloading" or "installing"
+ * while a package is being installed or updated, then "installed" or
+ * "failed". */
+static void
+gs_plugin_android_package_progress (GsPluginAndroid *self,
+                                    const gchar *package_name,
+                                    guint percentage,
+                                    const gchar *phase)
+{
+  for (GList *l = self->jobs; l != NULL; l = l->next) {
+    PackageJob *data = l->data;
+    GsApp *app = g_hash_table_lookup (data->pending, package_name);
 
-  for (guint i = 0; i < json_array_get_length (array); i++) {
-    JsonNode *element = json_array_get_element (array, i);
-    JsonObject *app_obj = json_node_get_object (element);
-    g_autoptr (GsApp) app = NULL;
+    if (app == NULL)
+      continue;
 
-    const gchar *id;
-    const gchar *name;
-    const gchar *summary;
-    const gchar *description;
-    const gchar *license;
-    const gchar *author;
-    const gchar *web_url;
-    const gchar *icon_url;
-    const gchar *repository;
-    JsonObject *package;
-    const gchar *version;
-    gboolean is_installed = FALSE;
-
-    id = json_object_get_string_member (app_obj, "id");
-    name = json_object_get_string_member (app_obj, "name");
-    summary = json_object_get_string_member (app_obj, "summary");
-    description = json_object_get_string_member (app_obj, "description");
-    license = json_object_get_string_member (app_obj, "license");
-    author = json_object_get_string_member (app_obj, "author");
-    web_url = json_object_get_string_member (app_obj, "web_url");
-    repository = json_object_get_string_member (app_obj, "repository");
-
-    package = json_object_get_object_member (app_obj, "package");
-    if (package) {
-      version = json_object_get_string_member (package, "version");
-      icon_url = json_object_get_string_member (package, "icon_url");
-
-      for (guint j = 0; j < gs_app_list_length (self->installed_apps); j++) {
-        GsApp *installed_app = gs_app_list_index (self->installed_apps, j);
-        const gchar *installed_name = gs_app_get_metadata_item (installed_app, "android::package-name");
-        if (g_strcmp0 (installed_name, id) == 0) {
-          is_installed = TRUE;
-          break;
-        }
-      }
+    /* Failures are left to the call's result, which may retry them */
+    if (g_strcmp0 (phase, "installed") == 0) {
+      gs_plugin_android_job_finish_app (self, data, app, TRUE);
+    } else if (g_strcmp0 (phase, "failed") == 0) {
+      g_hash_table_add (data->failed, (gpointer) gs_app_get_metadata_item (app, "android::package-name"));
+      gs_app_set_progress (app, GS_APP_PROGRESS_UNKNOWN);
+    } else {
+      gs_app_set_progress (app, MIN (percentage, 100));
+      gs_plugin_status_update (GS_PLUGIN (self), app,
+                               g_strcmp0 (phase, "downloading") == 0 ?
+                               GS_PLUGIN_STATUS_DOWNLOADING : GS_PLUGIN_STATUS_INSTALLING);
     }
 
-    app = gs_app_new (id);
-    gs_app_set_kind (app, AS_COMPONENT_KIND_DESKTOP_APP);
-    gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
-    gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
-    gs_app_add_quirk (app, GS_APP_QUIRK_HAS_SOURCE);
-    gs_app_set_metadata (app, "GnomeSoftware::Creator",
-                         gs_plugin_get_name (GS_PLUGIN (self)));
-    gs_app_set_management_plugin (app, GS_PLUGIN (self));
-    gs_app_set_metadata (app, "android::package-name", id);
-    gs_app_set_metadata (app, "android-store::repository", repository);
-    gs_app_add_source (app, id);
+    gs_plugin_android_job_report_progress (self, data);
+    return;
+  }
+}
 
-    gs_app_set_name (app, GS_APP_QUALITY_NORMAL, name);
-    gs_app_set_summary (app, GS_APP_QUALITY_NORMAL, summary);
-    gs_app_set_description (app, GS_APP_QUALITY_NORMAL, description);
-    gs_app_set_version (app, version);
-    gs_app_set_license (app, GS_APP_QUALITY_NORMAL, license);
-    gs_app_set_developer_name (app, author);
-    gs_app_set_url (app, AS_URL_KIND_HOMEPAGE, web_url);
-    gs_app_add_kudo (app, GS_APP_KUDO_SANDBOXED_SECURE);
-
-    if (icon_url != NULL) {
-        if (!g_str_has_prefix (icon_url, "http://") && !g_str_has_prefix (icon_url, "https://")) {
-            g_debug ("App '%s' has invalid icon URL: %s", name, icon_url);
-        } else {
-            g_autoptr (GIcon) icon = gs_remote_icon_new (icon_url);
-            gs_app_add_icon (app, icon);
-        }
-    }
-
-    gs_app_set_state (app, is_installed ? GS_APP_STATE_INSTALLED : GS_APP_STATE_AVAILABLE);
-    gs_app_list_add (list, app);
+/* Whether @package_name is one of the apps of a running job, even if the
+ * job is done with it already */
+static gboolean
+gs_plugin_android_is_job_package (GsPluginAndroid *self,
+                                  const gchar *package_name)
+{
+  for (GList *l = self->jobs; l != NULL; l = l->next) {
+    PackageJob *data = l->data;
+
+    if (app_list_find_package (data->list, package_name) != NULL)
+      return TRUE;
   }
 
-  g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+  return FALSE;
 }
 
-static GsAppList *
-gs_plugin_android_list_apps_finish (GsPlugin *plugin,
-                                    GAsyncResult *result,
-                                    GError **error)
+/* Marks @app failed, keeping @error as the one the job returns */
+static void
+gs_plugin_android_job_fail_app (GsPluginAndroid *self,
+                                PackageJob *data,
+                                GsApp *app,
+                                GError *error)
 {
-  return g_task_propagate_pointer (G_TASK (result), error);
+  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+  if (!g_hash_table_contains (data->pending, package_name))
+    return;
+
+  g_debug ("Giving up on %s: %s", package_name, error->message);
+  if (data->error == NULL)
+    data->error = g_error_copy (error);
+  data->n_failed++;
+  gs_plugin_android_job_finish_app (self, data, app, FALSE);
 }
 
+/* Queues @app to be downloaded and installed again, unless it is out of
+ * tries, so a failure doesn't redo the packages which went through */
 static void
-gs_plugin_android_list_apps_async (GsPlugin *plugin,
-                                   GsAppQuery *query,
-                                   GsPluginListAppsFlags flags,
-                                   GCancellable *cancellable,
-                                   GAsyncReadyCallback callback,
-                                   gpointer user_data)
+gs_plugin_android_job_retry_app (GsPluginAndroid *self,
+                                 GTask *task,
+                                 GsApp *app,
+                                 GError *error)
 {
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
-  g_autoptr (GTask) task = NULL;
-  GsAppQueryTristate is_installed = GS_APP_QUERY_TRISTATE_UNSET;
-  GsAppQueryTristate is_source = GS_APP_QUERY_TRISTATE_UNSET;
-  GsAppQueryTristate is_for_updates = GS_APP_QUERY_TRISTATE_UNSET;
-  const gchar * const *keywords = NULL;
+  PackageJob *data = g_task_get_task_data (task);
+  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+  guint attempts = GPOINTER_TO_UINT (g_hash_table_lookup (data->attempts, package_name));
 
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_android_list_apps_async);
+  if (!g_hash_table_contains (data->pending, package_name))
+    return;
 
-  if (query != NULL) {
-    is_source = gs_app_query_get_is_source (query);
-    is_installed = gs_app_query_get_is_installed (query);
-    is_for_updates = gs_app_query_get_is_for_update (query);
-    keywords = gs_app_query_get_keywords (query);
+  if (attempts + 1 >= JOB_MAX_ATTEMPTS ||
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+      g_cancellable_is_cancelled (g_task_get_cancellable (task))) {
+    gs_plugin_android_job_fail_app (self, data, app, error);
+    return;
   }
 
-  /* Currently only support one query type at a time */
-  if (gs_app_query_get_n_properties_set (query) != 1 ||
-      is_source == GS_APP_QUERY_TRISTATE_FALSE ||
-      is_installed == GS_APP_QUERY_TRISTATE_FALSE ||
-      is_for_updates == GS_APP_QUERY_TRISTATE_FALSE) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                             "Unsupported query");
-    return;
+  g_debug ("Retrying %s: %s", package_name, error->message);
+  g_hash_table_insert (data->attempts, (gpointer) package_name, GUINT_TO_POINTER (attempts + 1));
+  g_hash_table_remove (data->failed, package_name);
+  gs_app_set_progress (app, GS_APP_PROGRESS_UNKNOWN);
+  g_queue_push_tail (&data->download_queue, app);
+}
+
+/* For the calls which return (b), with FALSE for a failure */
+static gboolean
+fdroid_call_finish_boolean (GDBusProxy *proxy,
+                            GAsyncResult *res,
+                            GError **error)
+{
+  g_autoptr (GVariant) result = NULL;
+  gboolean success = FALSE;
+
+  result = g_dbus_proxy_call_finish (proxy, res, error);
+  if (result == NULL)
+    return FALSE;
+
+  g_variant_get (result, "(b)", &success);
+  if (!success) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "The Android store service reported a failure");
+    return FALSE;
   }
 
-  if (is_source == GS_APP_QUERY_TRISTATE_TRUE) {
-    g_debug ("Listing repositories");
+  return TRUE;
+}
+
+static void fdroid_download_package_cb (GObject *source_object,
+                                        GAsyncResult *res,
+                                        gpointer user_data);
+static void fdroid_apply_package_cb (GObject *source_object,
+                                     GAsyncResult *res,
+                                     gpointer user_data);
+static void fdroid_install_package_cb (GObject *source_object,
+                                       GAsyncResult *res,
+                                       gpointer user_data);
+static void fdroid_upgrade_packages_cb (GObject *source_object,
+                                        GAsyncResult *res,
+                                        gpointer user_data);
+
+/* Starts whatever the pipeline has room for, and returns the task once
+ * nothing is left running */
+static void
+gs_plugin_android_job_pump (GTask *task)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  PackageJob *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  gboolean cancelled = g_cancellable_is_cancelled (cancellable);
+
+  /* The container installs one package at a time */
+  if (!data->applying && !cancelled && !g_queue_is_empty (&data->apply_queue)) {
+    GsApp *app = g_queue_pop_head (&data->apply_queue);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+    data->applying = TRUE;
+    gs_plugin_status_update (GS_PLUGIN (self), app, GS_PLUGIN_STATUS_INSTALLING);
     g_dbus_proxy_call (self->fdroid_proxy,
-                       "GetRepositories",
-                       g_variant_new ("()"),
+                       "ApplyPackage",
+                       g_variant_new ("(s)", package_name),
                        G_DBUS_CALL_FLAGS_NONE,
                        -1,
                        cancellable,
-                       fdroid_get_repositories_cb,
-                       g_steal_pointer (&task));
-  } else if (is_installed == GS_APP_QUERY_TRISTATE_TRUE) {
-    g_debug ("Listing installed apps");
+                       fdroid_apply_package_cb,
+                       package_job_op_new (task, app));
+  }
+
+  while (data->n_downloads < self->max_downloads && !cancelled &&
+         !self->pipelined_updates_unsupported && !g_queue_is_empty (&data->download_queue)) {
+    GsApp *app = g_queue_pop_head (&data->download_queue);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+    data->n_downloads++;
+    gs_plugin_status_update (GS_PLUGIN (self), app, GS_PLUGIN_STATUS_DOWNLOADING);
     g_dbus_proxy_call (self->fdroid_proxy,
-                       "GetInstalledApps",
-                       g_variant_new ("()"),
+                       "DownloadPackage",
+                       g_variant_new ("(s)", package_name),
                        G_DBUS_CALL_FLAGS_NONE,
                        -1,
                        cancellable,
-                       fdroid_get_installed_apps_cb,
-                       g_steal_pointer (&task));
-  } else if (is_for_updates == GS_APP_QUERY_TRISTATE_TRUE) {
-    g_debug ("Listing updates");
+                       fdroid_download_package_cb,
+                       package_job_op_new (task, app));
+  }
+
+  if (data->applying || data->n_downloads > 0 || data->fallback_running)
+    return;
+
+  /* Older services download and install in a single call */
+  while (!cancelled && !g_queue_is_empty (&data->download_queue))
+    g_ptr_array_add (data->fallback, g_queue_pop_head (&data->download_queue));
+
+  /* Which takes one app at a time for installs */
+  if (data->fallback->len > 0 && !cancelled && !data->download_only && data->install) {
+    GsApp *app = g_ptr_array_index (data->fallback, 0);
+
+    data->fallback_running = TRUE;
+    gs_plugin_status_update (GS_PLUGIN (self), app, GS_PLUGIN_STATUS_INSTALLING);
     g_dbus_proxy_call (self->fdroid_proxy,
-                       "GetUpgradable",
-                       g_variant_new ("()"),
+                       "Install",
+                       g_variant_new ("(s)", gs_app_get_metadata_item (app, "android::package-name")),
                        G_DBUS_CALL_FLAGS_NONE,
                        -1,
                        cancellable,
-                       fdroid_get_upgradable_cb,
-                       g_steal_pointer (&task));
-  } else if (keywords != NULL) {
-    g_autofree gchar *query_str = NULL;
-    query_str = g_strjoinv (" ", (gchar **) keywords);
-    g_debug ("Searching for apps: %s", query_str);
+                       fdroid_install_package_cb,
+                       package_job_op_new (task, app));
+    return;
+  }
+
+  /* It can't download without installing, so a download-only pass ends here */
+  if (data->fallback->len > 0 && !cancelled && !data->download_only) {
+    g_autoptr (GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
+
+    for (guint i = 0; i < data->fallback->len; i++) {
+      GsApp *app = g_ptr_array_index (data->fallback, i);
+      g_variant_builder_add (builder, "s", gs_app_get_metadata_item (app, "android::package-name"));
+    }
 
+    data->fallback_running = TRUE;
     g_dbus_proxy_call (self->fdroid_proxy,
-                       "Search",
-                       g_variant_new ("(s)", query_str),
+                       self->upgrade_results_unsupported ? "UpgradePackages" : "UpgradePackagesWithResults",
+                       g_variant_new ("(as)", builder),
                        G_DBUS_CALL_FLAGS_NONE,
                        -1,
                        cancellable,
-                       fdroid_search_cb,
-                       g_steal_pointer (&task));
+                       fdroid_upgrade_packages_cb,
+                       g_object_ref (task));
+    return;
+  }
+
+  /* Whatever is still pending was never started */
+  if (cancelled && data->error == NULL)
+    g_cancellable_set_error_if_cancelled (cancellable, &data->error);
+  for (guint i = 0; i < gs_app_list_length (data->list); i++) {
+    GsApp *app = gs_app_list_index (data->list, i);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+
+    if (package_name != NULL && g_hash_table_contains (data->pending, package_name))
+      gs_plugin_android_job_finish_app (self, data, app, FALSE);
+  }
+
+  self->jobs = g_list_remove (self->jobs, data);
+  gs_plugin_updates_changed (GS_PLUGIN (self));
+
+  if (data->error != NULL) {
+    if (data->n_failed > 1)
+      g_prefix_error (&data->error, "%u of %u apps failed, first: ",
+                      data->n_failed, gs_app_list_length (data->list));
+    g_task_return_error (task, g_steal_pointer (&data->error));
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+fdroid_download_package_cb (GObject *source_object,
+                            GAsyncResult *res,
+                            gpointer user_data)
+{
+  g_autoptr (PackageJobOp) op = user_data;
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (op->task));
+  PackageJob *data = g_task_get_task_data (op->task);
+  const gchar *package_name = gs_app_get_metadata_item (op->app, "android::package-name");
+  g_autoptr (GError) local_error = NULL;
+
+  data->n_downloads--;
+
+  if (fdroid_call_finish_boolean (G_DBUS_PROXY (source_object), res, &local_error)) {
+    /* Kept even if installing fails, so a retry skips the download */
+    gs_plugin_android_stage_app (self, op->app);
+    if (g_hash_table_contains (data->pending, package_name)) {
+      if (data->download_only)
+        gs_plugin_android_job_finish_app (self, data, op->app, TRUE);
+      else
+        g_queue_push_tail (&data->apply_queue, op->app);
+    }
+  } else if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+    g_debug ("Service has no DownloadPackage, updating in one call");
+    self->pipelined_updates_unsupported = TRUE;
+    g_ptr_array_add (data->fallback, op->app);
   } else {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                             "Unsupported query type");
+    g_dbus_error_strip_remote_error (local_error);
+    g_prefix_error (&local_error, "Failed to download %s: ", package_name);
+    gs_plugin_android_job_retry_app (self, op->task, op->app, local_error);
   }
+
+  gs_plugin_android_job_report_progress (self, data);
+  gs_plugin_android_job_pump (op->task);
 }
 
 static void
-fdroid_install_app_cb (GObject *source_object,
-                       GAsyncResult *res,
-                       gpointer user_data)
+fdroid_apply_package_cb (GObject *source_object,
+                         GAsyncResult *res,
+                         gpointer user_data)
+{
+  g_autoptr (PackageJobOp) op = user_data;
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (op->task));
+  PackageJob *data = g_task_get_task_data (op->task);
+  const gchar *package_name = gs_app_get_metadata_item (op->app, "android::package-name");
+  g_autoptr (GError) local_error = NULL;
+
+  data->applying = FALSE;
+
+  if (fdroid_call_finish_boolean (G_DBUS_PROXY (source_object), res, &local_error)) {
+    if (g_hash_table_contains (data->pending, package_name))
+      gs_plugin_android_job_finish_app (self, data, op->app, TRUE);
+  } else {
+    g_dbus_error_strip_remote_error (local_error);
+    g_prefix_error (&local_error, "Failed to install %s: ", package_name);
+    gs_plugin_android_job_retry_app (self, op->task, op->app, local_error);
+  }
+
+  gs_plugin_android_job_report_progress (self, data);
+  gs_plugin_android_job_pump (op->task);
+}
+
+static void
+fdroid_install_package_cb (GObject *source_object,
+                           GAsyncResult *res,
+                           gpointer user_data)
+{
+  g_autoptr (PackageJobOp) op = user_data;
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (op->task));
+  PackageJob *data = g_task_get_task_data (op->task);
+  const gchar *package_name = gs_app_get_metadata_item (op->app, "android::package-name");
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) result = NULL;
+
+  data->fallback_running = FALSE;
+  g_ptr_array_remove (data->fallback, op->app);
+
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result != NULL) {
+    if (g_hash_table_contains (data->pending, package_name))
+      gs_plugin_android_job_finish_app (self, data, op->app, TRUE);
+  } else {
+    g_dbus_error_strip_remote_error (local_error);
+    g_prefix_error (&local_error, "Failed to install %s: ", package_name);
+    gs_plugin_android_job_retry_app (self, op->task, op->app, local_error);
+  }
+
+  gs_plugin_android_job_report_progress (self, data);
+  gs_plugin_android_job_pump (op->task);
+}
+
+/* UpgradePackagesWithResults returns (a(sbs)), a package name, whether it
+ * was updated and an error message for each package; UpgradePackages only
+ * returns (b) for the whole call */
+static void
+fdroid_upgrade_packages_cb (GObject *source_object,
+                            GAsyncResult *res,
+                            gpointer user_data)
 {
   g_autoptr (GTask) task = g_steal_pointer (&user_data);
   GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  PackageJob *data = g_task_get_task_data (task);
   g_autoptr (GError) local_error = NULL;
   g_autoptr (GVariant) result = NULL;
-  GsAppList *install_list = g_task_get_task_data (task);
+  g_autoptr (GVariant) results = NULL;
+  g_autoptr (GHashTable) result_index = NULL;
 
-  if (install_list == NULL || gs_app_list_length (install_list) == 0) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "No app in install list");
-    return;
-  }
+  data->fallback_running = FALSE;
 
-  GsApp *app = gs_app_list_index (install_list, 0);
-  if (app == NULL) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Failed to get app from install list");
+  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
+  if (result == NULL &&
+      g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD) &&
+      !self->upgrade_results_unsupported) {
+    /* The batch is still in fallback, so this sends it again */
+    g_debug ("Service has no UpgradePackagesWithResults, using UpgradePackages");
+    self->upgrade_results_unsupported = TRUE;
+    gs_plugin_android_job_pump (task);
     return;
   }
 
-  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
-  g_debug ("Installed F-Droid app: %s", package_name);
-
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
   if (result == NULL) {
-    gs_app_set_state_recover (app);
     g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
+    g_prefix_error (&local_error, "Failed to upgrade packages: ");
+  } else if (g_variant_is_of_type (result, G_VARIANT_TYPE ("(a(sbs))"))) {
+    results = g_variant_get_child_value (result, 0);
+    result_index = g_hash_table_new (g_str_hash, g_str_equal);
+    for (gsize i = 0; i < g_variant_n_children (results); i++) {
+      const gchar *package_name;
+
+      g_variant_get_child (results, i, "(&sb&s)", &package_name, NULL, NULL);
+      g_hash_table_insert (result_index, (gpointer) package_name, GSIZE_TO_POINTER (i + 1));
+    }
+  } else {
+    gboolean success = FALSE;
+
+    g_variant_get (result, "(b)", &success);
+    if (!success)
+      g_set_error_literal (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to upgrade packages");
+  }
+
+  for (guint i = 0; i < data->fallback->len; i++) {
+    GsApp *app = g_ptr_array_index (data->fallback, i);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+    g_autoptr (GError) app_error = NULL;
+
+    /* Finished by its own progress signal */
+    if (!g_hash_table_contains (data->pending, package_name))
+      continue;
+
+    if (result_index != NULL) {
+      gsize pos = GPOINTER_TO_SIZE (g_hash_table_lookup (result_index, package_name));
+      gboolean updated = FALSE;
+      const gchar *message = NULL;
+
+      if (pos > 0)
+        g_variant_get_child (results, pos - 1, "(&sb&s)", NULL, &updated, &message);
+      if (pos == 0)
+        app_error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "No result for %s", package_name);
+      else if (!updated)
+        app_error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "Failed to update %s: %s", package_name, message);
+    } else if (local_error != NULL) {
+      app_error = g_error_copy (local_error);
+    } else if (g_hash_table_contains (data->failed, package_name)) {
+      /* Without results, the signals tell which packages failed */
+      app_error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Failed to update %s", package_name);
+    }
+
+    if (app_error == NULL)
+      gs_plugin_android_job_finish_app (self, data, app, TRUE);
+    else
+      gs_plugin_android_job_retry_app (self, task, app, app_error);
+  }
+  g_ptr_array_set_size (data->fallback, 0);
+
+  gs_plugin_android_job_report_progress (self, data);
+  gs_plugin_android_job_pump (task);
+}
+
+static gboolean
+gs_plugin_android_update_apps_finish (GsPlugin *plugin,
+                                      GAsyncResult *result,
+                                      GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+gs_plugin_android_update_apps_async (GsPlugin *plugin,
+                                     GsAppList *list,
+                                     GsPluginUpdateAppsFlags flags,
+                                     GsPluginProgressCallback progress_callback,
+                                     gpointer progress_user_data,
+                                     GsPluginAppNeedsUserActionCallback app_needs_user_action_callback,
+                                     gpointer app_needs_user_action_data,
+                                     GCancellable *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer user_data)
+{
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
+  g_autoptr (GTask) task = NULL;
+  PackageJob *data;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_update_apps_async);
+
+  gs_plugin_status_update (plugin, NULL, GS_PLUGIN_STATUS_WAITING);
+
+  data = package_job_new (list, FALSE, (flags & GS_PLUGIN_UPDATE_APPS_FLAGS_NO_APPLY) != 0,
+                          progress_callback, progress_user_data);
+  g_task_set_task_data (task, data, (GDestroyNotify) package_job_free);
+
+  for (guint i = 0; i < gs_app_list_length (list); i++) {
+    GsApp *app = gs_app_list_index (list, i);
+    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+    gboolean staged;
+
+    if (package_name == NULL)
+      continue;
+
+    /* Updates downloaded by an earlier pass only need installing */
+    staged = gs_plugin_android_is_staged (self, app);
+    if (staged && (flags & GS_PLUGIN_UPDATE_APPS_FLAGS_NO_APPLY))
+      continue;
+    if (!staged && (flags & GS_PLUGIN_UPDATE_APPS_FLAGS_NO_DOWNLOAD)) {
+      g_debug ("Not updating %s, it has not been downloaded", package_name);
+      continue;
+    }
+
+    g_debug ("Adding package to upgrade: %s", package_name);
+    if (!(flags & GS_PLUGIN_UPDATE_APPS_FLAGS_NO_APPLY))
+      gs_app_set_state (app, GS_APP_STATE_INSTALLING);
+    gs_app_set_progress (app, GS_APP_PROGRESS_UNKNOWN);
+    g_hash_table_insert (data->pending, (gpointer) package_name, app);
+    if (staged)
+      g_queue_push_tail (&data->apply_queue, app);
+    else
+      g_queue_push_tail (&data->download_queue, app);
   }
 
-  gs_app_set_state (app, GS_APP_STATE_INSTALLED);
-  gs_plugin_updates_changed (GS_PLUGIN (self));
-  g_task_return_boolean (task, TRUE);
+  /* Progress signals for these packages are routed to this update */
+  self->jobs = g_list_prepend (self->jobs, data);
+
+  gs_plugin_android_job_pump (task);
 }
 
 static gboolean
@@ -609,22 +3698,19 @@ gs_plugin_android_install_apps_async (GsPlugin *plugin,
 {
   GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
   g_autoptr (GTask) task = NULL;
-  g_autoptr (GsAppList) install_list = gs_app_list_new ();
+  PackageJob *data;
 
   task = g_task_new (plugin, cancellable, callback, user_data);
   g_task_set_source_tag (task, gs_plugin_android_install_apps_async);
 
-  /* So far, we only support installing one app at a time */
-  if (flags &
-      (GS_PLUGIN_INSTALL_APPS_FLAGS_NO_DOWNLOAD |
-       GS_PLUGIN_INSTALL_APPS_FLAGS_NO_APPLY)) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                             "Unsupported flags");
-    return;
-  }
+  /* The job's list only gets the apps this plugin installs */
+  data = package_job_new (NULL, TRUE, (flags & GS_PLUGIN_INSTALL_APPS_FLAGS_NO_APPLY) != 0,
+                          progress_callback, progress_user_data);
+  g_task_set_task_data (task, data, (GDestroyNotify) package_job_free);
 
   for (guint i = 0; i < gs_app_list_length (list); i++) {
     GsApp *app = gs_app_list_index (list, i);
+    gboolean staged;
 
     /* enable repo, handled by dedicated function */
     g_assert (gs_app_get_kind (app) != AS_COMPONENT_KIND_REPOSITORY);
@@ -641,303 +3727,270 @@ gs_plugin_android_install_apps_async (GsPlugin *plugin,
       continue;
     }
 
-    g_debug ("Considering app %s for installation", package_name);
-
-    gs_app_list_add (install_list, app);
-    gs_app_set_state (app, GS_APP_STATE_INSTALLING);
-  }
-
-  if (gs_app_list_length (install_list) != 1) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                             "Can only install one app at a time");
-    return;
-  }
+    /* Packages downloaded by an earlier pass only need installing */
+    staged = gs_plugin_android_is_staged (self, app);
+    if (staged && data->download_only)
+      continue;
 
-  g_task_set_task_data (task, g_steal_pointer (&install_list), g_object_unref);
-  GsApp *app = gs_app_list_index (g_task_get_task_data (task), 0);
-  const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
+    g_debug ("Considering app %s for installation", package_name);
 
-  g_dbus_proxy_call (self->fdroid_proxy,
-                     "Install",
-                     g_variant_new ("(s)", package_name),
-                     G_DBUS_CALL_FLAGS_NONE,
-                     -1,
-                     cancellable,
-                     fdroid_install_app_cb,
-                     g_steal_pointer (&task));
-}
+    gs_app_list_add (data->list, app);
+    g_hash_table_insert (data->pending, (gpointer) package_name, app);
 
-static void
-fdroid_remove_repository_cb (GObject *source_object,
-                             GAsyncResult *res,
-                             gpointer user_data)
-{
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  GsApp *app = g_task_get_task_data (task);
+    if (!staged && (flags & GS_PLUGIN_INSTALL_APPS_FLAGS_NO_DOWNLOAD)) {
+      g_autoptr (GError) local_error = NULL;
 
-  g_debug ("Removing F-Droid repository: %s", gs_app_get_unique_id (app));
+      local_error = g_error_new (G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                 "%s has not been downloaded", package_name);
+      gs_plugin_android_job_fail_app (self, data, app, local_error);
+      continue;
+    }
 
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
-  if (result == NULL) {
-    gs_app_set_state_recover (app);
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
+    if (!data->download_only)
+      gs_app_set_state (app, GS_APP_STATE_INSTALLING);
+    gs_app_set_progress (app, GS_APP_PROGRESS_UNKNOWN);
+    if (staged)
+      g_queue_push_tail (&data->apply_queue, app);
+    else
+      g_queue_push_tail (&data->download_queue, app);
   }
 
-  gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
-  g_task_return_boolean (task, TRUE);
+  /* Progress signals for these packages are routed to this install */
+  self->jobs = g_list_prepend (self->jobs, data);
+
+  gs_plugin_android_job_pump (task);
 }
 
-static gboolean
-gs_plugin_android_remove_repository_finish (GsPlugin *plugin,
-                                            GAsyncResult *result,
-                                            GError **error)
+typedef struct {
+  GHashTable *pending_details;  /* package name → GsApp */
+  GsAppList *pending_icons;  /* apps whose icon isn't cached yet */
+  guint n_pending_ops;
+} RefineData;
+
+static void
+refine_data_free (RefineData *data)
 {
-  return g_task_propagate_boolean (G_TASK (result), error);
+  g_clear_pointer (&data->pending_details, g_hash_table_unref);
+  g_clear_object (&data->pending_icons);
+  g_free (data);
 }
 
+/* Details and icons are only nice to have, so neither fails the refine */
 static void
-gs_plugin_android_remove_repository_async (GsPlugin *plugin,
-                                           GsApp *repo,
-                                           GsPluginManageRepositoryFlags flags,
-                                           GCancellable *cancellable,
-                                           GAsyncReadyCallback callback,
-                                           gpointer user_data)
+refine_op_done (GTask *task)
 {
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
-  g_autoptr (GTask) task = NULL;
-
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_android_remove_repository_async);
-
-  g_assert (gs_app_get_kind (repo) == AS_COMPONENT_KIND_REPOSITORY);
-  g_task_set_task_data (task, g_object_ref (repo), g_object_unref);
-
-  gs_app_set_state (repo, GS_APP_STATE_REMOVING);
+  RefineData *data = g_task_get_task_data (task);
 
-  g_dbus_proxy_call (self->fdroid_proxy,
-                     "RemoveRepository",
-                     g_variant_new ("(s)", gs_app_get_id (repo)),
-                     G_DBUS_CALL_FLAGS_NONE,
-                     -1,
-                     cancellable,
-                     fdroid_remove_repository_cb,
-                     g_steal_pointer (&task));
+  if (--data->n_pending_ops == 0)
+    g_task_return_boolean (task, TRUE);
 }
 
 static void
-fdroid_uninstall_app_cb (GObject *source_object,
-                         GAsyncResult *res,
-                         gpointer user_data)
+fdroid_get_app_details_cb (GObject *source_object,
+                           GAsyncResult *res,
+                           gpointer user_data)
 {
   g_autoptr (GTask) task = g_steal_pointer (&user_data);
   GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
+  RefineData *data = g_task_get_task_data (task);
   g_autoptr (GError) local_error = NULL;
   g_autoptr (GVariant) result = NULL;
-  GsApp *app = g_task_get_task_data (task);
+  g_autoptr (GVariant) details = NULL;
+  GVariantIter iter;
+  GVariant *child;
 
   result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
   if (result == NULL) {
-    gs_app_set_state_recover (app);
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
+    if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+      /* Older services: go back to taking the details from search results,
+       * so drop the results which were built without them */
+      g_debug ("Service has no GetAppDetails, loading details eagerly");
+      self->app_details_unsupported = TRUE;
+      gs_plugin_android_search_cache_clear (self);
+    } else if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_dbus_error_strip_remote_error (local_error);
+      g_warning ("Failed to get Android app details: %s", local_error->message);
+    }
+    refine_op_done (task);
     return;
   }
 
-  gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
-  gs_plugin_updates_changed (GS_PLUGIN (self));
-  g_task_return_boolean (task, TRUE);
-}
+  details = g_variant_get_child_value (result, 0);
+  g_variant_iter_init (&iter, details);
+  while ((child = g_variant_iter_next_value (&iter))) {
+    SearchResult fields = { NULL, };
+    GsApp *app;
 
-static gboolean
-gs_plugin_android_uninstall_apps_finish (GsPlugin *plugin,
-                                         GAsyncResult *result,
-                                         GError **error)
-{
-  return g_task_propagate_boolean (G_TASK (result), error);
+    search_result_init_from_variant (&fields, child);
+    app = fields.id != NULL ? g_hash_table_lookup (data->pending_details, fields.id) : NULL;
+    if (app != NULL)
+      app_set_details (app, &fields);
+    g_variant_unref (child);
+  }
+
+  refine_op_done (task);
 }
 
 static void
-gs_plugin_android_uninstall_apps_async (GsPlugin *plugin,
-                                        GsAppList *list,
-                                        GsPluginUninstallAppsFlags flags,
-                                        GsPluginProgressCallback progress_callback,
-                                        gpointer progress_user_data,
-                                        GsPluginAppNeedsUserActionCallback app_needs_user_action_callback,
-                                        gpointer app_needs_user_action_data,
-                                        GCancellable *cancellable,
-                                        GAsyncReadyCallback callback,
-                                        gpointer user_data)
+cache_icons_thread_cb (GTask *task,
+                       gpointer source_object,
+                       gpointer task_data,
+                       GCancellable *cancellable)
 {
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
-  g_autoptr (GTask) task = NULL;
-  g_autoptr (GsAppList) uninstall_list = gs_app_list_new ();
-
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_android_uninstall_apps_async);
-
-  for (guint i = 0; i < gs_app_list_length (list); i++) {
-    GsApp *app = gs_app_list_index (list, i);
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (source_object);
+  GPtrArray *urls = task_data;
 
-    g_assert (gs_app_get_kind (app) != AS_COMPONENT_KIND_REPOSITORY);
-    g_debug ("Considering app %s for uninstallation", gs_app_get_unique_id (app));
+  for (guint i = 0; i < urls->len; i++) {
+    const gchar *url = g_ptr_array_index (urls, i);
+    g_autoptr (GPtrArray) cached = gs_android_icon_cache_lookup (url);
+    g_autoptr (GError) local_error = NULL;
 
-    if (!gs_app_has_management_plugin (app, plugin)) {
-      g_debug ("App %s is not managed by us, not uninstalling", gs_app_get_unique_id (app));
+    /* Prefetching may have got to it in the meantime */
+    if (cached->len > 0)
       continue;
-    }
-
-    gs_app_list_add (uninstall_list, app);
-    gs_app_set_state (app, GS_APP_STATE_REMOVING);
-  }
 
-  if (gs_app_list_length (uninstall_list) != 1) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                             "Can only uninstall one app at a time");
-    return;
+    if (!gs_android_icon_cache_fetch (self->soup_session, url, cancellable, &local_error)) {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        break;
+      g_debug ("Failed to cache icon %s: %s", url, local_error->message);
+    }
   }
 
-  g_task_set_task_data (task, g_object_ref (gs_app_list_index (uninstall_list, 0)), g_object_unref);
-
-  g_dbus_proxy_call (self->fdroid_proxy,
-                     "UninstallApp",
-                     g_variant_new ("(s)", gs_app_get_metadata_item (gs_app_list_index (uninstall_list, 0), "android::package-name")),
-                     G_DBUS_CALL_FLAGS_NONE,
-                     -1,
-                     cancellable,
-                     fdroid_uninstall_app_cb,
-                     g_steal_pointer (&task));
+  g_task_return_boolean (task, TRUE);
 }
 
-static gboolean
-gs_plugin_android_filter_desktop_file_cb (GsPlugin *plugin,
-                                          GsApp *app,
-                                          const gchar *filename,
-                                          GKeyFile *key_file,
-                                          gpointer user_data)
+static void
+cache_icons_cb (GObject *source_object,
+                GAsyncResult *res,
+                gpointer user_data)
 {
-  return strstr (filename, "/snapd/") == NULL &&
-         strstr (filename, "/snap/") == NULL &&
-         strstr (filename, "/flatpak/") == NULL &&
-         g_key_file_has_group (key_file, "Desktop Entry") &&
-         !g_key_file_has_key (key_file, "Desktop Entry", "X-Flatpak", NULL) &&
-         !g_key_file_has_key (key_file, "Desktop Entry", "X-SnapInstanceName", NULL);
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  RefineData *data = g_task_get_task_data (task);
+
+  /* Apps whose icon failed to download keep the remote icon */
+  for (guint i = 0; i < gs_app_list_length (data->pending_icons); i++) {
+    GsApp *app = gs_app_list_index (data->pending_icons, i);
+    const gchar *url = gs_app_get_metadata_item (app, "android::icon-url");
+
+    if (url != NULL)
+      app_add_cached_icons (app, url);
+  }
+
+  refine_op_done (task);
 }
 
 static gboolean
-gs_plugin_android_launch_finish (GsPlugin *plugin,
+gs_plugin_android_refine_finish (GsPlugin *plugin,
                                  GAsyncResult *result,
                                  GError **error)
 {
-  return gs_plugin_app_launch_filtered_finish (plugin, result, error);
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 static void
-gs_plugin_android_launch_async (GsPlugin *plugin,
-                                GsApp *app,
-                                GsPluginLaunchFlags flags,
+gs_plugin_android_refine_async (GsPlugin *plugin,
+                                GsAppList *list,
+                                GsPluginRefineFlags flags,
                                 GCancellable *cancellable,
                                 GAsyncReadyCallback callback,
                                 gpointer user_data)
-
 {
-  gs_plugin_app_launch_filtered_async (plugin, app, flags, gs_plugin_android_filter_desktop_file_cb, NULL, cancellable, callback, user_data);
-}
+  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (GPtrArray) icon_urls = NULL;
+  RefineData *data;
+  gboolean want_details;
+  gboolean want_icons;
+  GHashTableIter iter;
+  const gchar *package_name;
 
-static void
-fdroid_upgrade_packages_cb (GObject *source_object,
-                            GAsyncResult *res,
-                            gpointer user_data)
-{
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (g_task_get_source_object (task));
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  GsAppList *list = g_task_get_task_data (task);
-  gboolean success = FALSE;
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_android_refine_async);
 
-  result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &local_error);
-  if (result == NULL) {
-    g_dbus_error_strip_remote_error (local_error);
-    g_task_return_error (task, g_steal_pointer (&local_error));
-    return;
-  }
+  want_details = (flags & (GS_PLUGIN_REFINE_FLAGS_REQUIRE_DESCRIPTION |
+                           GS_PLUGIN_REFINE_FLAGS_REQUIRE_LICENSE |
+                           GS_PLUGIN_REFINE_FLAGS_REQUIRE_DEVELOPER_NAME |
+                           GS_PLUGIN_REFINE_FLAGS_REQUIRE_URL)) != 0;
+  want_icons = (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_ICON) != 0;
 
-  g_variant_get (result, "(b)", &success);
-  if (!success) {
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Failed to upgrade packages");
-    return;
-  }
+  data = g_new0 (RefineData, 1);
+  data->pending_details = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+  data->pending_icons = gs_app_list_new ();
+  g_task_set_task_data (task, data, (GDestroyNotify) refine_data_free);
+
+  icon_urls = g_ptr_array_new_with_free_func (g_free);
 
   for (guint i = 0; i < gs_app_list_length (list); i++) {
     GsApp *app = gs_app_list_index (list, i);
-    gs_app_set_state (app, GS_APP_STATE_INSTALLED);
-    g_debug ("Updated app: %s", gs_app_get_unique_id (app));
-  }
+    const gchar *icon_url;
 
-  gs_plugin_updates_changed (GS_PLUGIN (self));
-  g_task_return_boolean (task, TRUE);
-}
+    if (!gs_app_has_management_plugin (app, plugin))
+      continue;
 
-static gboolean
-gs_plugin_android_update_apps_finish (GsPlugin *plugin,
-                                      GAsyncResult *result,
-                                      GError **error)
-{
-  return g_task_propagate_boolean (G_TASK (result), error);
-}
+    package_name = gs_app_get_metadata_item (app, "android::package-name");
+    if (package_name == NULL)
+      continue;
 
-static void
-gs_plugin_android_update_apps_async (GsPlugin *plugin,
-                                     GsAppList *list,
-                                     GsPluginUpdateAppsFlags flags,
-                                     GsPluginProgressCallback progress_callback,
-                                     gpointer progress_user_data,
-                                     GsPluginAppNeedsUserActionCallback app_needs_user_action_callback,
-                                     gpointer app_needs_user_action_data,
-                                     GCancellable *cancellable,
-                                     GAsyncReadyCallback callback,
-                                     gpointer user_data)
-{
-  GsPluginAndroid *self = GS_PLUGIN_ANDROID (plugin);
-  g_autoptr (GTask) task = NULL;
-  g_autoptr (GVariantBuilder) builder = NULL;
+    /* Icons the prefetch is already getting are swapped in when it is done,
+     * rather than downloaded a second time */
+    icon_url = gs_app_get_metadata_item (app, "android::icon-url");
+    if (want_icons && icon_url != NULL && !app_has_cached_icons (app) &&
+        !app_add_cached_icons (app, icon_url) &&
+        !gs_plugin_android_icon_prefetch_join (self, icon_url, app)) {
+      gs_app_list_add (data->pending_icons, app);
+      g_ptr_array_add (icon_urls, g_strdup (icon_url));
+    }
 
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_android_update_apps_async);
+    if (want_details && gs_app_get_metadata_item (app, "android::details-loaded") == NULL) {
+      g_autoptr (GVariant) entry = NULL;
 
-  if (flags & GS_PLUGIN_UPDATE_APPS_FLAGS_NO_APPLY) {
-    g_task_return_boolean (task, TRUE);
-    return;
+      /* The local index has the whole catalog entry already */
+      if (self->search_index != NULL)
+        entry = gs_android_search_index_lookup (self->search_index, package_name);
+      if (entry != NULL) {
+        SearchResult fields = { NULL, };
+
+        search_result_init_from_variant (&fields, entry);
+        app_set_details (app, &fields);
+      } else if (!self->app_details_unsupported) {
+        g_hash_table_insert (data->pending_details, (gpointer) package_name, g_object_ref (app));
+      }
+    }
   }
 
-  gs_plugin_status_update (plugin, NULL, GS_PLUGIN_STATUS_WAITING);
+  /* Held until both lookups below have been started */
+  data->n_pending_ops = 1;
 
-  builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
-  for (guint i = 0; i < gs_app_list_length (list); i++) {
-    GsApp *app = gs_app_list_index (list, i);
-    const gchar *package_name = gs_app_get_metadata_item (app, "android::package-name");
-    if (package_name != NULL) {
-      g_debug ("Adding package to upgrade: %s", package_name);
+  if (g_hash_table_size (data->pending_details) > 0) {
+    g_autoptr (GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
+
+    /* One call for all apps in the list */
+    g_hash_table_iter_init (&iter, data->pending_details);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &package_name, NULL))
       g_variant_builder_add (builder, "s", package_name);
-      gs_app_set_state (app, GS_APP_STATE_INSTALLING);
-    }
+
+    data->n_pending_ops++;
+    g_dbus_proxy_call (self->fdroid_proxy,
+                       "GetAppDetails",
+                       g_variant_new ("(as)", builder),
+                       G_DBUS_CALL_FLAGS_NONE,
+                       -1,
+                       cancellable,
+                       fdroid_get_app_details_cb,
+                       g_object_ref (task));
   }
 
-  g_task_set_task_data (task, g_object_ref (list), g_object_unref);
+  if (icon_urls->len > 0) {
+    g_autoptr (GTask) icons_task = NULL;
 
-  g_dbus_proxy_call (self->fdroid_proxy,
-                     "UpgradePackages",
-                     g_variant_new ("(as)", builder),
-                     G_DBUS_CALL_FLAGS_NONE,
-                     -1,
-                     cancellable,
-                     fdroid_upgrade_packages_cb,
-                     g_steal_pointer (&task));
+    data->n_pending_ops++;
+    icons_task = g_task_new (self, cancellable, cache_icons_cb, g_object_ref (task));
+    g_task_set_source_tag (icons_task, cache_icons_thread_cb);
+    g_task_set_task_data (icons_task, g_steal_pointer (&icon_urls), (GDestroyNotify) g_ptr_array_unref);
+    g_task_run_in_thread (icons_task, cache_icons_thread_cb);
+  }
+
+  refine_op_done (task);
 }
 
 static void
@@ -948,8 +4001,27 @@ gs_plugin_android_init (GsPluginAndroid *self)
   gs_plugin_add_rule (plugin, GS_PLUGIN_RULE_RUN_BEFORE, "icons");
   gs_plugin_add_rule (plugin, GS_PLUGIN_RULE_RUN_BEFORE, "generic-updates");
 
+  self->soup_session = gs_build_soup_session ();
+  g_queue_init (&self->icon_prefetch_queue);
+  self->icon_prefetch_urls = g_hash_table_new (g_str_hash, g_str_equal);
+  self->icon_prefetch_cancellable = g_cancellable_new ();
+  self->max_icon_prefetch_jobs = ICON_PREFETCH_MAX_JOBS;
+  if (g_getenv ("GS_PLUGIN_ANDROID_ICON_JOBS") != NULL) {
+    guint64 jobs = g_ascii_strtoull (g_getenv ("GS_PLUGIN_ANDROID_ICON_JOBS"), NULL, 10);
+    self->max_icon_prefetch_jobs = CLAMP (jobs, 1, ICON_PREFETCH_MAX_JOBS_LIMIT);
+  }
+  self->max_downloads = JOB_MAX_DOWNLOADS;
+  if (g_getenv ("GS_PLUGIN_ANDROID_DOWNLOAD_JOBS") != NULL) {
+    guint64 jobs = g_ascii_strtoull (g_getenv ("GS_PLUGIN_ANDROID_DOWNLOAD_JOBS"), NULL, 10);
+    self->max_downloads = CLAMP (jobs, 1, JOB_MAX_DOWNLOADS_LIMIT);
+  }
   self->installed_apps = gs_app_list_new ();
-  self->updatable_apps = gs_app_list_new ();
+  self->installed_package_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->staged_packages = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->updatable_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  self->search_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify) search_cache_entry_free);
+  g_queue_init (&self->search_cache_lru);
 }
 
 static void
@@ -958,8 +4030,24 @@ gs_plugin_android_dispose (GObject *object)
   GsPluginAndroid *self = GS_PLUGIN_ANDROID (object);
 
   g_clear_object (&self->fdroid_proxy);
+  g_clear_handle_id (&self->reload_id, g_source_remove);
+  g_cancellable_cancel (self->icon_prefetch_cancellable);
+  g_clear_object (&self->icon_prefetch_cancellable);
+  g_clear_pointer (&self->icon_prefetch_urls, g_hash_table_unref);
+  g_queue_clear_full (&self->icon_prefetch_queue, (GDestroyNotify) icon_prefetch_free);
+  g_clear_object (&self->soup_session);
   g_clear_object (&self->installed_apps);
-  g_clear_object (&self->updatable_apps);
+  g_clear_pointer (&self->installed_package_names, g_hash_table_unref);
+  g_clear_pointer (&self->search_index, gs_android_search_index_free);
+  g_queue_clear (&self->search_cache_lru);
+  g_clear_pointer (&self->search_cache, g_hash_table_unref);
+  g_clear_object (&self->search_cancellable);
+  g_clear_pointer (&self->search_query, g_free);
+  g_clear_pointer (&self->updatable_apps, g_hash_table_unref);
+  g_clear_pointer (&self->staged_packages, g_hash_table_unref);
+  g_clear_pointer (&self->last_installed, g_variant_unref);
+  g_clear_pointer (&self->last_upgradable, g_variant_unref);
+  g_clear_pointer (&self->last_repositories, g_variant_unref);
 
   G_OBJECT_CLASS (gs_plugin_android_parent_class)->dispose (object);
 }
@@ -974,6 +4062,8 @@ gs_plugin_android_class_init (GsPluginAndroidClass *klass)
 
   plugin_class->setup_async = gs_plugin_android_setup_async;
   plugin_class->setup_finish = gs_plugin_android_setup_finish;
+  plugin_class->refine_async = gs_plugin_android_refine_async;
+  plugin_class->refine_finish = gs_plugin_android_refine_finish;
   plugin_class->refresh_metadata_async = gs_plugin_android_refresh_metadata_async;
   plugin_class->refresh_metadata_finish = gs_plugin_android_refresh_metadata_finish;
   plugin_class->list_apps_async = gs_plugin_android_list_apps_async;
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <bardia@furilabs.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/* The helpers under test are static, so the plugin is built into the test */
+#include "gs-plugin-android.c"
+
+/* Update checks fed through the updatable apps store, and packages installed */
+#define N_UPGRADABLE_REPLIES 200
+#define N_PACKAGES 100
+
+/* Returns the next element of @json from @offset, stripped, or NULL at the
+ * end of the array */
+static gchar *
+json_next (const gchar *json,
+           gsize *offset,
+           GError **error)
+{
+  gsize element_start;
+  gsize element_len;
+
+  if (!json_array_next_element (json, strlen (json), offset, &element_start, &element_len, error))
+    return NULL;
+
+  return g_strstrip (g_strndup (json + element_start, element_len));
+}
+
+static void
+test_json_array_next_element (void)
+{
+  const gchar *json = "[ {\"id\": \"a}\", \"tags\": [1, [2]]} ,\"s\\\"],\" ,[] , 42 ]";
+  g_autoptr (GError) local_error = NULL;
+  gsize offset = 1;
+  const gchar *elements[] = {
+    /* Brackets and commas inside strings or nested values don't count */
+    "{\"id\": \"a}\", \"tags\": [1, [2]]}",
+    "\"s\\\"],\"",
+    "[]",
+    "42",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (elements); i++) {
+    g_autofree gchar *element = json_next (json, &offset, &local_error);
+
+    g_assert_no_error (local_error);
+    g_assert_cmpstr (element, ==, elements[i]);
+  }
+
+  g_assert_null (json_next (json, &offset, &local_error));
+  g_assert_no_error (local_error);
+  g_assert_cmpuint (offset, ==, strlen (json));
+}
+
+static void
+test_json_array_next_element_empty (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  gsize offset = 1;
+
+  g_assert_null (json_next ("[ ]", &offset, &local_error));
+  g_assert_no_error (local_error);
+}
+
+static void
+test_json_array_next_element_truncated (void)
+{
+  const gchar *truncated[] = {
+    "[{\"id\": \"a\"",
+    "[\"abc",
+    "[{\"id\": \"a\"}, [1, 2",
+    "[1",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (truncated); i++) {
+    g_autoptr (GError) local_error = NULL;
+    g_autofree gchar *element = NULL;
+    gsize offset = 1;
+
+    g_test_message ("JSON: %s", truncated[i]);
+
+    /* Complete elements before the cut are still returned */
+    do {
+      g_clear_pointer (&element, g_free);
+      element = json_next (truncated[i], &offset, &local_error);
+    } while (element != NULL);
+
+    g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  }
+}
+
+static gchar *
+package_name_for_index (guint i)
+{
+  return g_strdup_printf ("org.example.app%u", i);
+}
+
+static GVariant *
+build_installed_entry (guint i)
+{
+  g_auto (GVariantDict) dict = G_VARIANT_DICT_INIT (NULL);
+  g_autofree gchar *package_name = package_name_for_index (i);
+
+  g_variant_dict_insert (&dict, "packageName", "s", package_name);
+  g_variant_dict_insert (&dict, "name", "s", package_name);
+  g_variant_dict_insert (&dict, "versionName", "s", "1.0");
+  g_variant_dict_insert (&dict, "versionCode", "x", (gint64) 1);
+
+  return g_variant_ref_sink (g_variant_dict_end (&dict));
+}
+
+/* Whether package @i has an update in @reply: half of the packages always
+ * have one, which gets replaced by every reply, the other half only in
+ * every other reply, so their entries are evicted in between */
+static gboolean
+reply_has_update (guint reply,
+                  guint i)
+{
+  return i % 2 == 0 || reply % 2 == 0;
+}
+
+static GVariant *
+build_upgradable_reply (guint reply)
+{
+  g_auto (GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("aa{sv}"));
+
+  for (guint i = 0; i < N_PACKAGES; i++) {
+    g_auto (GVariantDict) dict = G_VARIANT_DICT_INIT (NULL);
+    g_autofree gchar *package_name = NULL;
+    g_autofree gchar *available_version = NULL;
+
+    if (!reply_has_update (reply, i))
+      continue;
+
+    package_name = package_name_for_index (i);
+    available_version = g_strdup_printf ("1.%u", reply % 10 + 1);
+    g_variant_dict_insert (&dict, "packageName", "s", package_name);
+    g_variant_dict_insert (&dict, "name", "s", package_name);
+    g_variant_dict_insert (&dict, "currentVersion", "s", "1.0");
+    g_variant_dict_insert (&dict, "availableVersion", "s", available_version);
+    g_variant_dict_insert (&dict, "repository", "s", "F-Droid");
+    g_variant_builder_add_value (&builder, g_variant_dict_end (&dict));
+  }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Feeds @reply through the store the way fdroid_get_upgradable_cb does and
+ * checks that it holds exactly the updates of the reply */
+static void
+check_upgradable_reply (GsPluginAndroid *self,
+                        GPtrArray *installed,
+                        guint reply)
+{
+  g_autoptr (GVariant) entries = build_upgradable_reply (reply);
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GsAppList) cached_updatable = gs_app_list_new ();
+  guint n_updates = 0;
+
+  list = gs_plugin_android_load_upgradable (self, entries);
+
+  for (guint i = 0; i < N_PACKAGES; i++) {
+    GsApp *app = g_ptr_array_index (installed, i);
+    g_autofree gchar *package_name = package_name_for_index (i);
+
+    if (reply_has_update (reply, i)) {
+      /* Replaced in place, never duplicated */
+      g_assert_true (g_hash_table_lookup (self->updatable_apps, package_name) == app);
+      g_assert_cmpint (gs_app_get_state (app), ==, GS_APP_STATE_UPDATABLE);
+      n_updates++;
+    } else {
+      g_assert_false (g_hash_table_contains (self->updatable_apps, package_name));
+      g_assert_cmpint (gs_app_get_state (app), ==, GS_APP_STATE_INSTALLED);
+    }
+  }
+
+  g_assert_cmpuint (gs_app_list_length (list), ==, n_updates);
+  g_assert_cmpuint (g_hash_table_size (self->updatable_apps), ==, n_updates);
+
+  /* Updates are found on the interned apps, not on copies of them */
+  gs_plugin_cache_lookup_by_state (GS_PLUGIN (self), cached_updatable, GS_APP_STATE_UPDATABLE);
+  g_assert_cmpuint (gs_app_list_length (cached_updatable), ==, n_updates);
+
+  /* GsApp notifies from idle callbacks, which would pile up otherwise */
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static void
+test_updatable_apps_memory (void)
+{
+  g_autoptr (GsPluginAndroid) self = g_object_new (GS_TYPE_PLUGIN_ANDROID, NULL);
+  g_autoptr (GPtrArray) installed = g_ptr_array_new ();
+
+  for (guint i = 0; i < N_PACKAGES; i++) {
+    g_autoptr (GVariant) entry = build_installed_entry (i);
+
+    g_ptr_array_add (installed, gs_plugin_android_add_installed_app (self, entry));
+  }
+
+  /* Every reply replaces or evicts the apps of the one before, so the
+   * store never grows past the installed packages */
+  for (guint reply = 0; reply < N_UPGRADABLE_REPLIES; reply++)
+    check_upgradable_reply (self, installed, reply);
+
+  g_assert_cmpuint (gs_app_list_length (self->installed_apps), ==, N_PACKAGES);
+  g_assert_cmpuint (g_hash_table_size (self->updatable_apps), <=, N_PACKAGES);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/android/json-array-next-element", test_json_array_next_element);
+  g_test_add_func ("/android/json-array-next-element/empty", test_json_array_next_element_empty);
+  g_test_add_func ("/android/json-array-next-element/truncated", test_json_array_next_element_truncated);
+  g_test_add_func ("/android/updatable-apps/memory", test_updatable_apps_memory);
+
+  return g_test_run ();
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <bardia@furilabs.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "gs-android-search-index.h"
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+static GVariant *
+build_entry (const gchar *id,
+             const gchar *name,
+             const gchar *summary,
+             const gchar *author,
+             gint64 version_code)
+{
+  g_auto (GVariantDict) dict = G_VARIANT_DICT_INIT (NULL);
+
+  g_variant_dict_insert (&dict, "id", "s", id);
+  g_variant_dict_insert (&dict, "name", "s", name);
+  if (summary != NULL)
+    g_variant_dict_insert (&dict, "summary", "s", summary);
+  if (author != NULL)
+    g_variant_dict_insert (&dict, "author", "s", author);
+  if (version_code >= 0)
+    g_variant_dict_insert (&dict, "versionCode", "x", version_code);
+
+  return g_variant_dict_end (&dict);
+}
+
+static GVariant *
+build_catalog (void)
+{
+  g_auto (GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("aa{sv}"));
+
+  g_variant_builder_add_value (&builder, build_entry ("org.fdroid.fdroid", "F-Droid",
+                                                      "The app store for free software",
+                                                      "F-Droid Limited", 1019050));
+  g_variant_builder_add_value (&builder, build_entry ("org.mozilla.fennec_fdroid", "Fennec",
+                                                      "Web browser based on Firefox",
+                                                      "Mozilla", 1190020));
+  g_variant_builder_add_value (&builder, build_entry ("de.danoeh.antennapod", "AntennaPod",
+                                                      "Easy-to-use podcast manager",
+                                                      "AntennaPod Team", -1));
+  g_variant_builder_add_value (&builder, build_entry ("com.example.Überapp", "Überapp",
+                                                      NULL, NULL, 7));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Returns the ids of @entries, in order, joined with spaces */
+static gchar *
+entries_to_ids (GPtrArray *entries)
+{
+  g_autoptr (GString) ids = g_string_new (NULL);
+
+  for (guint i = 0; i < entries->len; i++) {
+    const gchar *id = NULL;
+
+    g_variant_lookup (g_ptr_array_index (entries, i), "id", "&s", &id);
+    if (ids->len > 0)
+      g_string_append_c (ids, ' ');
+    g_string_append (ids, id);
+  }
+
+  return g_string_free (g_steal_pointer (&ids), FALSE);
+}
+
+static gchar *
+query_ids (GsAndroidSearchIndex *index,
+           const gchar *query)
+{
+  g_auto (GStrv) keywords = g_strsplit (query, " ", -1);
+  g_autoptr (GPtrArray) results = gs_android_search_index_query (index, (const gchar * const *) keywords);
+
+  return entries_to_ids (results);
+}
+
+static void
+check_queries (GsAndroidSearchIndex *index)
+{
+  struct {
+    const gchar *query;
+    const gchar *ids;
+  } queries[] = {
+    /* Keywords match any token they are a prefix of, case insensitively */
+    { "fdroid", "org.fdroid.fdroid org.mozilla.fennec_fdroid" },
+    { "FENN", "org.mozilla.fennec_fdroid" },
+    { "pod", "de.danoeh.antennapod" },
+    { "napod", "" },
+    /* Every keyword has to match */
+    { "web mozilla", "org.mozilla.fennec_fdroid" },
+    { "web store", "" },
+    /* Summary and author are indexed too */
+    { "free software", "org.fdroid.fdroid" },
+    { "team", "de.danoeh.antennapod" },
+    { "über", "com.example.Überapp" },
+    /* Punctuation only gives no tokens, so nothing matches */
+    { "--", "" },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (queries); i++) {
+    g_autofree gchar *ids = query_ids (index, queries[i].query);
+
+    g_test_message ("Query: %s", queries[i].query);
+    g_assert_cmpstr (ids, ==, queries[i].ids);
+  }
+}
+
+static void
+check_lookups (GsAndroidSearchIndex *index)
+{
+  g_autoptr (GVariant) entry = NULL;
+  const gchar *name = NULL;
+
+  entry = gs_android_search_index_lookup (index, "org.mozilla.fennec_fdroid");
+  g_assert_nonnull (entry);
+  g_assert_true (g_variant_lookup (entry, "name", "&s", &name));
+  g_assert_cmpstr (name, ==, "Fennec");
+  g_clear_pointer (&entry, g_variant_unref);
+
+  /* Ids are matched exactly, not as a prefix or a token */
+  g_assert_null (gs_android_search_index_lookup (index, "org.mozilla"));
+  g_assert_null (gs_android_search_index_lookup (index, "fdroid"));
+  g_assert_null (gs_android_search_index_lookup (index, "org.example.missing"));
+
+  entry = gs_android_search_index_lookup (index, "com.example.Überapp");
+  g_assert_nonnull (entry);
+}
+
+static void
+check_versions (GsAndroidSearchIndex *index)
+{
+  GArray *versions = gs_android_search_index_get_versions (index);
+  const GsAndroidSearchIndexVersion *version;
+
+  /* Entries without a versionCode are left out, the rest sorted by id */
+  g_assert_cmpuint (versions->len, ==, 3);
+  version = &g_array_index (versions, GsAndroidSearchIndexVersion, 0);
+  g_assert_cmpstr (version->id, ==, "com.example.Überapp");
+  g_assert_cmpint (version->version_code, ==, 7);
+  version = &g_array_index (versions, GsAndroidSearchIndexVersion, 1);
+  g_assert_cmpstr (version->id, ==, "org.fdroid.fdroid");
+  g_assert_cmpint (version->version_code, ==, 1019050);
+  version = &g_array_index (versions, GsAndroidSearchIndexVersion, 2);
+  g_assert_cmpstr (version->id, ==, "org.mozilla.fennec_fdroid");
+  g_assert_cmpint (version->version_code, ==, 1190020);
+
+  /* Built once, then cached */
+  g_assert_true (gs_android_search_index_get_versions (index) == versions);
+}
+
+static void
+test_search_index_query (void)
+{
+  g_autoptr (GVariant) catalog = build_catalog ();
+  g_autoptr (GsAndroidSearchIndex) index = gs_android_search_index_new (catalog);
+
+  check_queries (index);
+  check_lookups (index);
+  check_versions (index);
+}
+
+static void
+test_search_index_empty (void)
+{
+  g_autoptr (GVariant) catalog = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("a{sv}"), NULL, 0));
+  g_autoptr (GsAndroidSearchIndex) index = gs_android_search_index_new (catalog);
+  g_autofree gchar *ids = query_ids (index, "fdroid");
+
+  g_assert_cmpstr (ids, ==, "");
+  g_assert_null (gs_android_search_index_lookup (index, "org.fdroid.fdroid"));
+  g_assert_cmpuint (gs_android_search_index_get_versions (index)->len, ==, 0);
+}
+
+static void
+test_search_index_save_load (void)
+{
+  g_autoptr (GVariant) catalog = build_catalog ();
+  g_autoptr (GsAndroidSearchIndex) index = gs_android_search_index_new (catalog);
+  g_autoptr (GsAndroidSearchIndex) loaded = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *filename = NULL;
+
+  dir = g_dir_make_tmp ("gs-android-search-index-XXXXXX", &local_error);
+  g_assert_no_error (local_error);
+  filename = g_build_filename (dir, "search-index", NULL);
+
+  g_assert_true (gs_android_search_index_save (index, filename, &local_error));
+  g_assert_no_error (local_error);
+
+  /* The loaded index answers the same as the one it was saved from */
+  loaded = gs_android_search_index_load (filename, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (loaded);
+  check_queries (loaded);
+  check_lookups (loaded);
+  check_versions (loaded);
+
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+static void
+test_search_index_load_invalid (void)
+{
+  g_autoptr (GsAndroidSearchIndex) loaded = NULL;
+  g_autoptr (GVariant) data = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *filename = NULL;
+
+  dir = g_dir_make_tmp ("gs-android-search-index-XXXXXX", &local_error);
+  g_assert_no_error (local_error);
+  filename = g_build_filename (dir, "search-index", NULL);
+
+  loaded = gs_android_search_index_load (filename, &local_error);
+  g_assert_error (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+  g_assert_null (loaded);
+  g_clear_error (&local_error);
+
+  /* An index written by another format version is refused */
+  data = g_variant_ref_sink (g_variant_new_parsed ("(@u 999, @aa{sv} [], @a(sau) [])"));
+  g_assert_true (g_file_set_contents (filename, g_variant_get_data (data),
+                                      g_variant_get_size (data), &local_error));
+  g_assert_no_error (local_error);
+
+  loaded = gs_android_search_index_load (filename, &local_error);
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (loaded);
+
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/android/search-index/query", test_search_index_query);
+  g_test_add_func ("/android/search-index/empty", test_search_index_empty);
+  g_test_add_func ("/android/search-index/save-load", test_search_index_save_load);
+  g_test_add_func ("/android/search-index/load-invalid", test_search_index_load_invalid);
+
+  return g_test_run ();
+}